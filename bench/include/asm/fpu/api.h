@@ -0,0 +1,17 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark: minimal stand-in for <asm/fpu/api.h>
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define kernel_fpu_begin()	do { } while (0)
+#define kernel_fpu_end()	do { } while (0)
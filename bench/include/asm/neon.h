@@ -0,0 +1,18 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark: minimal stand-in for <asm/neon.h>
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define cpu_has_neon()		true
+#define kernel_neon_begin()	do { } while (0)
+#define kernel_neon_end()	do { } while (0)
@@ -0,0 +1,22 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark: minimal stand-in for <asm/simd.h>
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdbool.h>
+
+/* like the kernel on arm and arm64: no vector unit with irqs off. Set by
+ * the benchmark to check the scalar fallback */
+extern bool bench_irqs_off;
+
+#define may_use_simd()		(!bench_irqs_off)
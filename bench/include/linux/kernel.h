@@ -0,0 +1,45 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark: minimal stand-in for <linux/kernel.h>
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MYTEK_BENCH_LINUX_KERNEL_H
+#define MYTEK_BENCH_LINUX_KERNEL_H
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef uint16_t __le16;
+typedef uint32_t __le32;
+typedef uint32_t __be32;
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+#define cpu_to_le32(x)		htole32(x)
+#define le16_to_cpup(p)		le16toh(*(p))
+#define le32_to_cpup(p)		le32toh(*(p))
+#define be32_to_cpup(p)		be32toh(*(p))
+
+#define min(a, b)		((a) < (b) ? (a) : (b))
+#define ARRAY_SIZE(a)		(sizeof(a) / sizeof((a)[0]))
+
+#endif
@@ -0,0 +1,33 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark: minimal stand-in for <sound/pcm.h>
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MYTEK_BENCH_SOUND_PCM_H
+#define MYTEK_BENCH_SOUND_PCM_H
+
+#include <linux/kernel.h>
+
+/* values as in <sound/asound.h> */
+typedef int snd_pcm_format_t;
+
+#define SNDRV_PCM_FORMAT_S16_LE		2
+#define SNDRV_PCM_FORMAT_S24_LE		6
+#define SNDRV_PCM_FORMAT_S32_LE		10
+#define SNDRV_PCM_FORMAT_S24_3LE	32
+#define SNDRV_PCM_FORMAT_DSD_U8		48
+#define SNDRV_PCM_FORMAT_DSD_U16_LE	49
+#define SNDRV_PCM_FORMAT_DSD_U32_LE	50
+#define SNDRV_PCM_FORMAT_DSD_U32_BE	52
+
+#endif
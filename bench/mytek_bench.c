@@ -0,0 +1,584 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Userspace benchmark for the out urb packing path
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Builds pack.c (and pack_simd.c where available) against the small
+ * kernel shims in bench/include and measures the per urb packing cost
+ * for every rate, format and channel count, with a large ring and with
+ * a small ring that wraps inside nearly every packet.
+ *
+ * The packing code as it was before the fused packer (memset, per frame
+ * memcpy, separate header/marker walk) is kept here as reference: every
+ * configuration is verified against it byte for byte before timing.
+ *
+ * Native DSD formats are packed to DoP at 176.4k and verified against a
+ * plain per byte DoP reference. The DoP packer setup of compress start
+ * is checked on a fresh runtime in both endpoint modes.
+ *
+ * Where vector kernels exist they are verified with irqs on and, through
+ * the may_use_simd() shim, off, where the scalar ones must take over.
+ *
+ * Usage: mytek-bench [urbs per measurement]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../pack.h"
+
+/* keep synced with pcm.h and pcm.c (packets_per_urb default) */
+static const int rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
+enum {
+	PCM_N_PACKETS_PER_URB = 8, PCM_MAX_PACKET_SIZE = 604,
+	OUT_N_CHANNELS = 6, MAX_BUFSIZE = 128 * 1024
+};
+
+enum {
+	BENCH_N_SEQ = 64, /* urbs in the simulated packet size sequence */
+	BENCH_SMALL_RING = 97, /* frames, wraps inside most packets */
+	BENCH_DEFAULT_URBS = 20000
+};
+
+static const struct {
+	snd_pcm_format_t format;
+	const char *name;
+	unsigned int width; /* bytes per sample */
+} formats[] = {
+	{ SNDRV_PCM_FORMAT_S24_LE, "S24_LE", 4 },
+	{ SNDRV_PCM_FORMAT_S32_LE, "S32_LE", 4 },
+	{ SNDRV_PCM_FORMAT_S16_LE, "S16_LE", 2 },
+	{ SNDRV_PCM_FORMAT_S24_3LE, "S24_3LE", 3 }
+};
+
+#ifdef MYTEK_PACK_DSD
+static const struct {
+	snd_pcm_format_t format;
+	const char *name;
+	unsigned int width; /* bytes per channel and alsa frame */
+} dsd_formats[] = {
+	{ SNDRV_PCM_FORMAT_DSD_U8, "DSD_U8", 1 },
+	{ SNDRV_PCM_FORMAT_DSD_U16_LE, "DSD_U16_LE", 2 },
+	{ SNDRV_PCM_FORMAT_DSD_U32_LE, "DSD_U32_LE", 4 },
+	{ SNDRV_PCM_FORMAT_DSD_U32_BE, "DSD_U32_BE", 4 }
+};
+#endif
+
+struct bench_urb {
+	unsigned int frames[PCM_N_PACKETS_PER_URB];
+};
+
+/* 4 spare bytes in front, the old S32_LE path writes to buffer - 1 */
+static u8 storage[4 + PCM_N_PACKETS_PER_URB * PCM_MAX_PACKET_SIZE];
+static u8 reference[PCM_N_PACKETS_PER_URB * PCM_MAX_PACKET_SIZE];
+static u8 *buffer = storage + 4;
+static u8 ring_area[MAX_BUFSIZE];
+static struct bench_urb seq[BENCH_N_SEQ];
+
+/* frames per packet as the device's implicit feedback would deliver them:
+ * one packet per 125us microframe */
+static void bench_init_seq(int rate)
+{
+	unsigned int phase = 0;
+	int i;
+	int k;
+
+	for (i = 0; i < BENCH_N_SEQ; i++)
+		for (k = 0; k < PCM_N_PACKETS_PER_URB; k++) {
+			phase += rate;
+			seq[i].frames[k] = phase / 8000;
+			phase %= 8000;
+		}
+}
+
+static unsigned int bench_width(snd_pcm_format_t format)
+{
+	size_t f;
+
+	for (f = 0; f < ARRAY_SIZE(formats); f++)
+		if (formats[f].format == format)
+			return formats[f].width;
+	return 4;
+}
+
+/* S16_LE and S24_3LE to S32_LE, as alsa-lib's plug does before the old
+ * driver sees them */
+static const u8 *bench_plug(u32 *dest, const u8 *src,
+		snd_pcm_format_t format, unsigned int channels)
+{
+	unsigned int channel;
+
+	for (channel = 0; channel < channels; channel++)
+		if (format == SNDRV_PCM_FORMAT_S16_LE) {
+			dest[channel] = (u32) (src[0] | src[1] << 8) << 16;
+			src += 2;
+		} else {
+			dest[channel] = (u32) (src[0] | src[1] << 8
+					| src[2] << 16) << 8;
+			src += 3;
+		}
+	return (const u8 *) dest;
+}
+
+/* packing as done by mytek_pcm_in_urb_handler before the fused packer */
+static int bench_legacy(u8 *out, const struct bench_urb *urb,
+		snd_pcm_format_t format, unsigned int channels,
+		struct pack_ring *ring)
+{
+	unsigned int width = bench_width(format);
+	int total_length = 0;
+	int frames = 0;
+	unsigned int frame;
+	unsigned int channel;
+	int i;
+	u8 *src = (u8 *) ring->area + ring->pos * channels * width;
+	u32 plug[OUT_N_CHANNELS];
+	u8 *dest;
+
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++)
+		total_length += urb->frames[i] * (OUT_N_CHANNELS << 2) + 4;
+	memset(out, 0, total_length);
+
+	dest = format == SNDRV_PCM_FORMAT_S24_LE ? out : out - 1;
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
+		dest += 4;
+		for (frame = 0; frame < urb->frames[i]; frame++) {
+			memcpy(dest, width == 4 ? src : bench_plug(plug, src,
+						format, channels),
+					channels << 2);
+			src += channels * width;
+			dest += OUT_N_CHANNELS << 2;
+			if (++ring->pos == ring->size) {
+				src = (u8 *) ring->area;
+				ring->pos = 0;
+			}
+		}
+		frames += urb->frames[i];
+	}
+
+	dest = out;
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
+		*(dest++) = 0xaa;
+		*(dest++) = 0xaa;
+		*(dest++) = urb->frames[i];
+		*(dest++) = 0x00;
+		for (frame = 0; frame < urb->frames[i]; frame++)
+			for (channel = 0; channel < OUT_N_CHANNELS; channel++) {
+				dest += 3;
+				*(dest++) = 0x40;
+			}
+	}
+	return frames;
+}
+
+/* the driver sends mono to slots 0 and 1, the old path to slot 0 only */
+static void bench_mono(u8 *out, const struct bench_urb *urb)
+{
+	unsigned int frame;
+	int i;
+
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
+		out += 4;
+		for (frame = 0; frame < urb->frames[i]; frame++) {
+			memcpy(out + 4, out, 4);
+			out += OUT_N_CHANNELS << 2;
+		}
+	}
+}
+
+static int bench_fused(u8 *out, const struct bench_urb *urb,
+		struct pcm_packer *p, struct pack_ring *ring)
+{
+	int frames = 0;
+	int i;
+
+	mytek_pack_begin(p);
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
+		out = mytek_pack_packet(p, out, urb->frames[i], ring);
+		frames += urb->frames[i];
+	}
+	mytek_pack_end(p);
+	return frames;
+}
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#ifdef MYTEK_PACK_DSD
+/* byte t of the DSD stream of a channel, oldest first */
+static u8 bench_dsd_byte(snd_pcm_format_t format, unsigned int width,
+		unsigned int channels, unsigned int ring_size, unsigned int c,
+		unsigned long t)
+{
+	unsigned long frame = t / width % ring_size;
+	unsigned int k = t % width;
+
+	/* little endian words hold the oldest byte in the msb */
+	if (format != SNDRV_PCM_FORMAT_DSD_U32_BE)
+		k = width - 1 - k;
+	return ring_area[(frame * channels + c) * width + k];
+}
+
+/* DoP, one byte at a time. *dop counts DoP frames played from the ring,
+ * *sent all DoP frames. Idle urbs carry DoP silence */
+static void bench_dop(u8 *out, const struct bench_urb *urb,
+		snd_pcm_format_t format, unsigned int width,
+		unsigned int channels, unsigned int ring_size,
+		unsigned long *dop, unsigned long *sent, bool idle)
+{
+	unsigned int frame;
+	unsigned int slot;
+	unsigned int c;
+	int i;
+
+	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
+		*(out++) = 0xaa;
+		*(out++) = 0xaa;
+		*(out++) = urb->frames[i];
+		*(out++) = 0x00;
+		for (frame = 0; frame < urb->frames[i]; frame++, (*sent)++) {
+			for (slot = 0; slot < OUT_N_CHANNELS; slot++) {
+				/* mono goes to slots 0 and 1 */
+				c = channels == 1 && slot == 1 ? 0 : slot;
+				if (c >= channels) {
+					out[0] = out[1] = out[2] = 0;
+				} else if (idle) {
+					out[0] = out[1] = 0x69;
+					out[2] = *sent & 1 ? 0xfa : 0x05;
+				} else {
+					out[0] = bench_dsd_byte(format, width,
+							channels, ring_size,
+							c, *dop * 2 + 1);
+					out[1] = bench_dsd_byte(format, width,
+							channels, ring_size,
+							c, *dop * 2);
+					out[2] = *sent & 1 ? 0xfa : 0x05;
+				}
+				out[3] = 0x40;
+				out += 4;
+			}
+			if (!idle)
+				(*dop)++;
+		}
+	}
+}
+
+static int bench_verify_dsd(struct pcm_packer *p, snd_pcm_format_t format,
+		unsigned int width, unsigned int channels,
+		unsigned int ring_size)
+{
+	struct pack_ring ring = { ring_area,
+			mytek_pack_dev_frames(p, ring_size), 0 };
+	unsigned long dop = 0;
+	unsigned long sent = 0;
+	bool idle;
+	u8 *dest;
+	int length;
+	int i;
+	int k;
+
+	for (i = 0; i < BENCH_N_SEQ; i++) {
+		/* a paused stream now and then */
+		idle = i % 4 == 3;
+		bench_dop(reference, &seq[i], format, width, channels,
+				ring_size, &dop, &sent, idle);
+		memset(buffer, 0x55, sizeof(reference));
+		if (idle) {
+			dest = buffer;
+			for (k = 0; k < PCM_N_PACKETS_PER_URB; k++)
+				dest = mytek_pack_dop_silence(p, dest,
+						seq[i].frames[k]);
+		} else
+			bench_fused(buffer, &seq[i], p, &ring);
+
+		length = 0;
+		for (k = 0; k < PCM_N_PACKETS_PER_URB; k++)
+			length += seq[i].frames[k] * (OUT_N_CHANNELS << 2) + 4;
+		if (memcmp(reference, buffer, length)
+				|| ring.pos != dop % ring.size)
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Compress start on a runtime no pcm stream has run on yet: the packer
+ * gets its slot count from the endpoint mode alone. Sets up a zeroed
+ * packer for DSD_U8 the way the compress trigger does and checks the
+ * DoP silence it sends first.
+ */
+static int bench_compr_start(void)
+{
+	struct pcm_packer packer;
+	unsigned int channels;
+	unsigned int slots;
+	unsigned int slot;
+	unsigned int frame;
+	const u8 *out;
+	bool idle;
+	int stereo;
+
+	for (stereo = 0; stereo <= 1; stereo++) {
+		slots = mytek_pack_out_slots(stereo);
+		for (channels = 1; channels <= slots; channels++) {
+			memset(&packer, 0, sizeof(packer));
+			if (mytek_pack_init(&packer, SNDRV_PCM_FORMAT_DSD_U8,
+						channels, slots))
+				return -1;
+			mytek_pack_dop_silence(&packer, buffer, 2);
+			out = buffer + 4;
+			for (frame = 0; frame < 2; frame++)
+			for (slot = 0; slot < slots; slot++, out += 4) {
+				/* mono goes to slots 0 and 1 */
+				idle = slot < channels
+						|| (channels == 1 && slot == 1);
+				if (out[0] != (idle ? 0x69 : 0)
+						|| out[1] != (idle ? 0x69 : 0)
+						|| out[2] != (!idle ? 0 : frame
+							? 0xfa : 0x05)
+						|| out[3] != 0x40)
+					return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* DoP packing at 176.4k, returns non zero on mismatch */
+static int bench_dsd(int urbs)
+{
+	struct pcm_packer packer;
+	struct pack_ring ring;
+	unsigned int channels;
+	unsigned int ring_size;
+	double start;
+	double ns;
+	long frames;
+	size_t f;
+	int small;
+	int i;
+
+	if (bench_compr_start()) {
+		printf("\ncompress start MISMATCH\n");
+		return 1;
+	}
+
+	printf("\n%-10s %2s %-5s %8s %9s\n", "DoP 176.4k", "ch", "ring",
+			"ns/frame", "ns/urb");
+	bench_init_seq(176400);
+	for (f = 0; f < ARRAY_SIZE(dsd_formats); f++)
+	for (channels = 1; channels <= OUT_N_CHANNELS; channels++)
+	for (small = 0; small <= 1; small++) {
+		/* DSD_U8 rings hold whole DoP frames (even sizes) */
+		ring_size = small ? BENCH_SMALL_RING + 1 : MAX_BUFSIZE
+				/ (channels * dsd_formats[f].width);
+		ring_size &= ~1u;
+
+		mytek_pack_init(&packer, dsd_formats[f].format, channels,
+				OUT_N_CHANNELS);
+		if (bench_verify_dsd(&packer, dsd_formats[f].format,
+					dsd_formats[f].width, channels,
+					ring_size)) {
+			printf("%-10s %2u %-5s MISMATCH\n",
+					dsd_formats[f].name, channels,
+					small ? "small" : "large");
+			return 1;
+		}
+
+		ring.area = ring_area;
+		ring.size = mytek_pack_dev_frames(&packer, ring_size);
+		ring.pos = 0;
+		frames = 0;
+		start = bench_now();
+		for (i = 0; i < urbs; i++)
+			frames += bench_fused(buffer, &seq[i % BENCH_N_SEQ],
+					&packer, &ring);
+		ns = (bench_now() - start) / urbs;
+		printf("%-10s %2u %-5s %8.2f %9.1f\n", dsd_formats[f].name,
+				channels, small ? "small" : "large",
+				ns * urbs / frames, ns);
+	}
+	return 0;
+}
+#endif
+
+/* returns ns per urb, frames packed in *frames */
+static double bench_time(struct pcm_packer *p, snd_pcm_format_t format,
+		unsigned int channels, unsigned int ring_size, int urbs,
+		long *frames)
+{
+	struct pack_ring ring = { ring_area, ring_size, 0 };
+	double start;
+	int i;
+
+	*frames = 0;
+	start = bench_now();
+	for (i = 0; i < urbs; i++)
+		*frames += p ? bench_fused(buffer, &seq[i % BENCH_N_SEQ], p,
+					&ring)
+				: bench_legacy(buffer, &seq[i % BENCH_N_SEQ],
+					format, channels, &ring);
+	return (bench_now() - start) / urbs;
+}
+
+static int bench_verify(struct pcm_packer *p, snd_pcm_format_t format,
+		unsigned int channels, unsigned int ring_size)
+{
+	struct pack_ring legacy_ring = { ring_area, ring_size, 0 };
+	struct pack_ring fused_ring = { ring_area, ring_size, 0 };
+	int length;
+	int i;
+	int k;
+
+	for (i = 0; i < BENCH_N_SEQ; i++) {
+		bench_legacy(buffer, &seq[i], format, channels, &legacy_ring);
+		if (channels == 1)
+			bench_mono(buffer, &seq[i]);
+		memcpy(reference, buffer, sizeof(reference));
+		memset(buffer, 0x55, sizeof(reference));
+		bench_fused(buffer, &seq[i], p, &fused_ring);
+
+		length = 0;
+		for (k = 0; k < PCM_N_PACKETS_PER_URB; k++)
+			length += seq[i].frames[k] * (OUT_N_CHANNELS << 2) + 4;
+		if (memcmp(reference, buffer, length)
+				|| legacy_ring.pos != fused_ring.pos)
+			return -1;
+	}
+	return 0;
+}
+
+bool bench_irqs_off;
+
+/*
+ * the urb completions pack with irqs on, .ack with irqs off. There the
+ * vector kernels must not be picked and the scalar ones must give the
+ * same output.
+ */
+static int bench_verify_irqs_off(struct pcm_packer *p,
+		snd_pcm_format_t format, unsigned int channels,
+		unsigned int ring_size)
+{
+	int ret = 0;
+
+	bench_irqs_off = true;
+	mytek_pack_begin(p);
+	if (p->simd || p->pack != p->pack_scalar)
+		ret = -1;
+	mytek_pack_end(p);
+	if (!ret)
+		ret = bench_verify(p, format, channels, ring_size);
+	bench_irqs_off = false;
+	return ret;
+}
+
+int main(int argc, char **argv)
+{
+	int urbs = argc > 1 ? atoi(argv[1]) : BENCH_DEFAULT_URBS;
+	struct pcm_packer scalar;
+	struct pcm_packer simd;
+	unsigned int channels;
+	unsigned int ring_size;
+	double legacy_ns;
+	double scalar_ns;
+	double simd_ns;
+	double best_ns;
+	long frames;
+	size_t r;
+	size_t f;
+	size_t i;
+	int small;
+
+	if (urbs <= 0)
+		urbs = BENCH_DEFAULT_URBS;
+	for (i = 0; i < sizeof(ring_area); i++)
+		ring_area[i] = rand();
+
+	printf("%d urbs of %d packets per measurement, ns per frame\n\n",
+			urbs, PCM_N_PACKETS_PER_URB);
+	printf("%7s %-7s %2s %-5s %8s %8s %8s %9s %9s\n", "rate", "format",
+			"ch", "ring", "legacy", "fused", "simd", "ns/urb",
+			"MB/s");
+
+	for (r = 0; r < ARRAY_SIZE(rates); r++) {
+		bench_init_seq(rates[r]);
+		for (f = 0; f < ARRAY_SIZE(formats); f++)
+		for (channels = 1; channels <= OUT_N_CHANNELS; channels++)
+		for (small = 0; small <= 1; small++) {
+			ring_size = small ? BENCH_SMALL_RING
+					: MAX_BUFSIZE / (channels
+						* formats[f].width);
+
+			mytek_pack_init(&scalar, formats[f].format, channels,
+					OUT_N_CHANNELS);
+			scalar.pack_simd = NULL;
+			mytek_pack_init(&simd, formats[f].format, channels,
+					OUT_N_CHANNELS);
+
+			if (bench_verify(&scalar, formats[f].format, channels,
+						ring_size)
+					|| (simd.pack_simd && (bench_verify(&simd,
+						formats[f].format, channels,
+						ring_size)
+					|| bench_verify_irqs_off(&simd,
+						formats[f].format, channels,
+						ring_size)))) {
+				printf("%7d %-7s %2u %-5s MISMATCH\n", rates[r],
+						formats[f].name, channels,
+						small ? "small" : "large");
+				return 1;
+			}
+
+			legacy_ns = bench_time(NULL, formats[f].format,
+					channels, ring_size, urbs, &frames);
+			scalar_ns = bench_time(&scalar, formats[f].format,
+					channels, ring_size, urbs, &frames);
+			best_ns = scalar_ns;
+			simd_ns = 0;
+			if (simd.pack_simd) {
+				simd_ns = bench_time(&simd, formats[f].format,
+						channels, ring_size, urbs,
+						&frames);
+				if (simd_ns < best_ns)
+					best_ns = simd_ns;
+			}
+
+			frames /= urbs;
+			printf("%7d %-7s %2u %-5s %8.2f %8.2f ", rates[r],
+					formats[f].name, channels,
+					small ? "small" : "large",
+					legacy_ns / frames, scalar_ns / frames);
+			if (simd_ns)
+				printf("%8.2f ", simd_ns / frames);
+			else
+				printf("%8s ", "-");
+			printf("%9.1f %9.1f\n", best_ns,
+					frames * channels * formats[f].width
+					* 1e3
+					/ best_ns);
+		}
+	}
+#ifdef MYTEK_PACK_DSD
+	return bench_dsd(urbs);
+#else
+	return 0;
+#endif
+}
@@ -20,6 +20,7 @@
 #include "pcm.h"
 #include "control.h"
 #include "comm.h"
+#include "compress.h"
 
 #include <linux/moduleparam.h>
 #include <linux/interrupt.h>
@@ -38,6 +39,7 @@ static char *id[SNDRV_CARDS] = SNDRV_DEFAULT_STR; /* Id for card */
 static bool enable[SNDRV_CARDS] = SNDRV_DEFAULT_ENABLE_PNP; /* Enable card */
 static struct mytek_chip *chips[SNDRV_CARDS] = SNDRV_DEFAULT_PTR;
 static struct usb_device *devices[SNDRV_CARDS] = SNDRV_DEFAULT_PTR;
+static bool stereo; /* 2 channel out endpoint */
 
 module_param_array(index, int, NULL, 0444);
 MODULE_PARM_DESC(index, "Index value for the mytek sound device");
@@ -45,12 +47,16 @@ module_param_array(id, charp, NULL, 0444);
 MODULE_PARM_DESC(id, "ID string for the mytek sound device.");
 module_param_array(enable, bool, NULL, 0444);
 MODULE_PARM_DESC(enable, "Enable the mytek sound device.");
+module_param(stereo, bool, 0444);
+MODULE_PARM_DESC(stereo, "Stereo only, smaller usb packets. Set at firmware upload: power cycle the dac after changing.");
 
 static DEFINE_MUTEX(register_mutex);
 
 static void mytek_chip_abort(struct mytek_chip *chip)
 {
 	if (chip) {
+		if (chip->compr)
+			mytek_compr_abort(chip);
 		if (chip->pcm)
 			mytek_pcm_abort(chip);
 		if (chip->comm)
@@ -68,6 +74,8 @@ static void mytek_chip_abort(struct mytek_chip *chip)
 static void mytek_chip_destroy(struct mytek_chip *chip)
 {
 	if (chip) {
+		if (chip->compr)
+			mytek_compr_destroy(chip);
 		if (chip->pcm)
 			mytek_pcm_destroy(chip);
 		if (chip->comm)
@@ -87,6 +95,7 @@ static int mytek_chip_probe(struct usb_interface *intf,
 	struct mytek_chip *chip = NULL;
 	struct usb_device *device = interface_to_usbdev(intf);
 	int regidx = -1; /* index in module parameter array */
+	bool is_stereo;
 	struct snd_card *card = NULL;
 
 	/* look if we already serve this card and return if so */
@@ -110,13 +119,22 @@ static int mytek_chip_probe(struct usb_interface *intf,
 	mutex_unlock(&register_mutex);
 
 	/* check, if firmware is present on device, upload it if not */
-	ret = mytek_fw_init(intf);
+	ret = mytek_fw_init(intf, stereo);
 
 	if (ret < 0)
 		return ret;
 	else if (ret == FW_NOT_READY) /* firmware update performed */
 		return 0;
 
+	/* the parameter only applies at firmware upload */
+	ret = mytek_fw_stereo(intf);
+	if (ret < 0)
+		return ret;
+	if (ret != stereo)
+		dev_info(&intf->dev, "out endpoint sized for %s, power cycle the dac to apply stereo=%d.\n",
+				ret ? "stereo" : "6 channels", stereo);
+	is_stereo = ret;
+
 	/* if we are here, card can be registered in alsa. */
 	if (usb_set_interface(device, 0, 0) != 0) {
 		dev_err(&intf->dev, "cannot set first interface.\n");
@@ -140,6 +158,7 @@ static int mytek_chip_probe(struct usb_interface *intf,
 	chip->regidx = regidx;
 	chip->intf_count = 1;
 	chip->card = card;
+	chip->stereo = is_stereo;
 
 	ret = mytek_comm_init(chip);
 	if (ret < 0) {
@@ -159,6 +178,12 @@ static int mytek_chip_probe(struct usb_interface *intf,
 		return ret;
 	}
 
+	ret = mytek_compr_init(chip);
+	if (ret < 0) {
+		mytek_chip_destroy(chip);
+		return ret;
+	}
+
 	ret = snd_card_register(card);
 	if (ret < 0) {
 		dev_err(&intf->dev, "cannot register card.\n");
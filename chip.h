@@ -29,11 +29,12 @@ struct mytek_chip {
 	int intf_count; /* number of registered interfaces */
 	int regidx; /* index in module parameter arrays */
 	bool shutdown;
-	bool usbworkaround;
+	bool stereo; /* out endpoint sized for 2 channels, see mytek_fw_stereo */
 
 	struct pcm_runtime *pcm;
 	struct control_runtime *control;
 	struct comm_runtime *comm;
+	struct compr_runtime *compr;
 };
 
 #endif /* MYTEK_CHIP_H */
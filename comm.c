@@ -23,6 +23,8 @@ enum {
 	COMM_FPGA_EP = 2
 };
 
+#define COMM_SHADOW_VALID	0x10000
+
 static void mytek_comm_init_urb(struct comm_runtime *rt, struct urb *urb,
 		u8 *buffer, void *context, void(*handler)(struct urb *urb))
 {
@@ -35,10 +37,58 @@ static void mytek_comm_init_urb(struct comm_runtime *rt, struct urb *urb,
 	urb->dev = rt->chip->dev;
 }
 
+/*
+ * The device answers on the interrupt in endpoint. Responses are assumed
+ * to echo the request with the register value filled in:
+ * 0x01 <length> 0x02 <cmdid> <reg> <vl> <vh>, length counting from the
+ * request byte. Several messages may share one transfer. Anything that
+ * does not match an outstanding read is ignored.
+ */
+static void mytek_comm_parse(struct comm_runtime *rt, const u8 *buffer,
+		int length)
+{
+	struct comm_read *read;
+	const u8 *msg;
+	unsigned long flags;
+	bool wake = false;
+	int i;
+	int k;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	for (i = 0; i + 2 <= length && buffer[i] == 0x01;
+			i += buffer[i + 1] + 2) {
+		msg = buffer + i + 2;
+		if (i + 2 + buffer[i + 1] > length)
+			break;
+		if (buffer[i + 1] < 5 || msg[0] != 0x02)
+			continue;
+
+		for (k = 0; k < COMM_N_READS; k++) {
+			read = &rt->reads[k];
+			if (read->pending && !read->done
+					&& read->cmdid == msg[1]
+					&& read->reg == msg[2]) {
+				read->vl = msg[3];
+				read->vh = msg[4];
+				read->done = true;
+				rt->answered = true;
+				wake = true;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	if (wake)
+		wake_up(&rt->wait);
+}
+
 static void mytek_comm_receiver_handler(struct urb *urb)
 {
 	struct comm_runtime *rt = urb->context;
 
+	if (!urb->status)
+		mytek_comm_parse(rt, rt->receiver_buffer, urb->actual_length);
+
 	if (!rt->chip->shutdown) {
 		urb->status = 0;
 		urb->actual_length = 0;
@@ -85,69 +135,265 @@ static void mytek_comm_init_buffer(u8 *buffer, u8 id, u8 request,
 	}
 }
 
-static int mytek_comm_send_buffer(u8 *buffer, struct usb_device *dev)
+static void mytek_comm_cmd_handler(struct urb *urb)
 {
-	int ret;
-	int actual_len;
+	struct comm_urb *cmd = urb->context;
+	struct comm_runtime *rt = cmd->rt;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	if (!rt->error) {
+		if (urb->status)
+			rt->error = urb->status;
+		else if (urb->actual_length != urb->transfer_buffer_length)
+			rt->error = -EIO;
+	}
+	/* write failed, device state for this register is unknown */
+	if ((urb->status || urb->actual_length != urb->transfer_buffer_length)
+			&& cmd->shadow >= 0)
+		rt->shadow[cmd->shadow] = 0;
+	cmd->busy = false;
+	rt->n_busy--;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	wake_up(&rt->wait);
+}
 
-	ret = usb_interrupt_msg(dev, usb_sndintpipe(dev, COMM_EP),
-			buffer, buffer[1] + 2, &actual_len, HZ);
-	if (ret < 0)
-		return ret;
-	else if (actual_len != buffer[1] + 2)
-		return -EIO;
+/* index in rt->shadow for a write, -1 if it must not be cached */
+static int mytek_comm_shadow_index(u8 request, u8 reg)
+{
+	switch (request) {
+	case 0x02:
+		return reg < COMM_N_REGS ? reg : -1;
+	case 0x20:
+	case 0x21:
+	case 0x22:
+		if (reg >= COMM_N_GPIOS)
+			return -1;
+		return COMM_N_REGS + (request - 0x20) * COMM_N_GPIOS + reg;
+	}
+	return -1;
+}
 
-	return 0;
+static u32 mytek_comm_shadow_value(u8 vl, u8 vh)
+{
+	return COMM_SHADOW_VALID | vl << 8 | vh;
 }
 
-static int mytek_comm_write8(struct comm_runtime *rt, u8 request,
-		u8 reg, u8 value)
+static bool mytek_comm_is_cached(struct comm_runtime *rt, u8 request,
+		u8 reg, u8 vl, u8 vh)
+{
+	int idx = mytek_comm_shadow_index(request, reg);
+
+	return idx >= 0 && READ_ONCE(rt->shadow[idx])
+			== mytek_comm_shadow_value(vl, vh);
+}
+
+static void mytek_comm_invalidate(struct comm_runtime *rt)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	memset(rt->shadow, 0, sizeof(rt->shadow));
+	spin_unlock_irqrestore(&rt->lock, flags);
+}
+
+/* claim a free command urb and give it the next cmdid, NULL if none */
+static struct comm_urb *mytek_comm_get_cmd(struct comm_runtime *rt)
+{
+	struct comm_urb *cmd = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	for (i = 0; i < COMM_N_URBS; i++)
+		if (!rt->cmds[i].busy) {
+			cmd = &rt->cmds[i];
+			cmd->busy = true;
+			cmd->cmdid = rt->cmdid;
+			rt->n_busy++;
+
+			if (rt->cmdid == 255)
+				rt->cmdid = 0;
+			else
+				rt->cmdid = rt->cmdid+1;
+			break;
+		}
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	return cmd;
+}
+
+/* claim a free read slot, NULL if none */
+static struct comm_read *mytek_comm_get_read(struct comm_runtime *rt)
+{
+	struct comm_read *read = NULL;
+	unsigned long flags;
+	int i;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	for (i = 0; i < COMM_N_READS; i++)
+		if (!rt->reads[i].busy) {
+			read = &rt->reads[i];
+			read->busy = true;
+			break;
+		}
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	return read;
+}
+
+/* queue a command, 'read' (if any) is armed with its cmdid */
+static int mytek_comm_queue(struct comm_runtime *rt, u8 request,
+		u8 reg, u8 vl, u8 vh, struct comm_read *read)
 {
-	u8 *buffer;
+	struct comm_urb *cmd;
+	unsigned long flags;
+	int idx = mytek_comm_shadow_index(request, reg);
+	u32 value = mytek_comm_shadow_value(vl, vh);
 	int ret;
 
-	/* 13: maximum length of message */
-	buffer = kmalloc(13, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	/* skip writes of values the device already has */
+	if (idx >= 0) {
+		spin_lock_irqsave(&rt->lock, flags);
+		if (rt->shadow[idx] == value) {
+			spin_unlock_irqrestore(&rt->lock, flags);
+			return 0;
+		}
+		rt->shadow[idx] = value;
+		spin_unlock_irqrestore(&rt->lock, flags);
+	}
 
-	mytek_comm_init_buffer(buffer, rt->cmdid, request, reg, value, 0x00);
+	/* all command urbs in flight: wait for one to complete */
+	if (!wait_event_timeout(rt->wait, (cmd = mytek_comm_get_cmd(rt)),
+			HZ)) {
+		mytek_comm_invalidate(rt);
+		return -ETIMEDOUT;
+	}
 
-	if (rt->cmdid == 255) 
-		rt->cmdid = 0;
-	else
-		rt->cmdid = rt->cmdid+1;
+	if (read) {
+		spin_lock_irqsave(&rt->lock, flags);
+		read->cmdid = cmd->cmdid;
+		read->pending = true;
+		spin_unlock_irqrestore(&rt->lock, flags);
+	}
 
-	ret = mytek_comm_send_buffer(buffer, rt->chip->dev);
+	cmd->shadow = idx;
+	mytek_comm_init_buffer(cmd->buffer, cmd->cmdid, request, reg, vl, vh);
+	cmd->instance.transfer_buffer_length = cmd->buffer[1] + 2;
 
-	kfree(buffer);
+	ret = usb_submit_urb(&cmd->instance, GFP_KERNEL);
+	if (ret < 0) {
+		spin_lock_irqsave(&rt->lock, flags);
+		if (idx >= 0)
+			rt->shadow[idx] = 0;
+		cmd->busy = false;
+		rt->n_busy--;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		wake_up(&rt->wait);
+	}
 	return ret;
 }
 
+static int mytek_comm_write8(struct comm_runtime *rt, u8 request,
+		u8 reg, u8 value)
+{
+	return mytek_comm_queue(rt, request, reg, value, 0x00, NULL);
+}
+
 static int mytek_comm_write16(struct comm_runtime *rt, u8 request,
 		u8 reg, u8 vl, u8 vh)
 {
-	u8 *buffer;
+	return mytek_comm_queue(rt, request, reg, vl, vh, NULL);
+}
+
+static int mytek_comm_read16(struct comm_runtime *rt, u8 reg,
+		u8 *vl, u8 *vh)
+{
+	struct comm_read *read;
+	unsigned long flags;
 	int ret;
 
-	/* 13: maximum length of message */
-	buffer = kmalloc(13, GFP_KERNEL);
-	if (!buffer)
-		return -ENOMEM;
+	if (rt->no_response)
+		return -EOPNOTSUPP;
+
+	if (!wait_event_timeout(rt->wait, (read = mytek_comm_get_read(rt)),
+			HZ))
+		return -ETIMEDOUT;
+
+	read->reg = reg | 0x80;
+	ret = mytek_comm_queue(rt, 0x02, read->reg, 0x00, 0x00, read);
+	if (!ret && !wait_event_timeout(rt->wait,
+			READ_ONCE(read->done) || rt->chip->shutdown,
+			msecs_to_jiffies(COMM_READ_TIMEOUT))) {
+		ret = -ETIMEDOUT;
+		if (!rt->answered) {
+			dev_warn(&rt->chip->dev->dev,
+					"device does not answer register reads.\n");
+			rt->no_response = true;
+			ret = -EOPNOTSUPP;
+		}
+	}
+
+	spin_lock_irqsave(&rt->lock, flags);
+	if (!ret && !read->done)
+		ret = -ENODEV;
+	if (!ret) {
+		*vl = read->vl;
+		*vh = read->vh;
+	}
+	read->busy = false;
+	read->pending = false;
+	read->done = false;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	wake_up(&rt->wait);
+	return ret;
+}
 
-	mytek_comm_init_buffer(buffer, rt->cmdid, request, reg, vl, vh);
+static int mytek_comm_flush(struct comm_runtime *rt)
+{
+	unsigned long flags;
+	int ret;
 
-	if (rt->cmdid == 255) 
-		rt->cmdid = 0;
-	else
-		rt->cmdid = rt->cmdid+1;
+	if (!wait_event_timeout(rt->wait, !READ_ONCE(rt->n_busy), HZ)) {
+		mytek_comm_invalidate(rt);
+		return -ETIMEDOUT;
+	}
 
-	ret = mytek_comm_send_buffer(buffer, rt->chip->dev);
+	spin_lock_irqsave(&rt->lock, flags);
+	ret = rt->error;
+	rt->error = 0;
+	spin_unlock_irqrestore(&rt->lock, flags);
 
-	kfree(buffer);
 	return ret;
 }
 
+static void mytek_comm_cmds_destroy(struct comm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < COMM_N_URBS; i++)
+		kfree(rt->cmds[i].buffer);
+}
+
+static int mytek_comm_cmds_init(struct comm_runtime *rt)
+{
+	struct comm_urb *cmd;
+	int i;
+
+	for (i = 0; i < COMM_N_URBS; i++) {
+		cmd = &rt->cmds[i];
+		cmd->buffer = kmalloc(COMM_MAX_MESSAGE, GFP_KERNEL);
+		if (!cmd->buffer)
+			return -ENOMEM;
+		cmd->rt = rt;
+		rt->init_urb(rt, &cmd->instance, cmd->buffer, cmd,
+				mytek_comm_cmd_handler);
+	}
+	return 0;
+}
+
 int mytek_comm_init(struct mytek_chip *chip)
 {
 	struct comm_runtime *rt = kzalloc(sizeof(struct comm_runtime),
@@ -168,9 +414,23 @@ int mytek_comm_init(struct mytek_chip *chip)
 	rt->serial = 1;
 	rt->chip = chip;
 	usb_init_urb(urb);
+	spin_lock_init(&rt->lock);
+	init_waitqueue_head(&rt->wait);
 	rt->init_urb = mytek_comm_init_urb;
 	rt->write8 = mytek_comm_write8;
 	rt->write16 = mytek_comm_write16;
+	rt->read16 = mytek_comm_read16;
+	rt->flush = mytek_comm_flush;
+	rt->is_cached = mytek_comm_is_cached;
+	rt->invalidate = mytek_comm_invalidate;
+
+	ret = mytek_comm_cmds_init(rt);
+	if (ret < 0) {
+		mytek_comm_cmds_destroy(rt);
+		kfree(rt->receiver_buffer);
+		kfree(rt);
+		return ret;
+	}
 
 	/* Initialise unique ID for transmission to and from USBPAL.
 	 * Can be used to track responses from USBPAL to issued cmd's
@@ -188,6 +448,7 @@ int mytek_comm_init(struct mytek_chip *chip)
 	urb->interval = 1;
 	ret = usb_submit_urb(urb, GFP_KERNEL);
 	if (ret < 0) {
+		mytek_comm_cmds_destroy(rt);
 		kfree(rt->receiver_buffer);
 		kfree(rt);
 		dev_err(&chip->dev->dev, "cannot create comm data receiver.\n");
@@ -200,15 +461,22 @@ int mytek_comm_init(struct mytek_chip *chip)
 void mytek_comm_abort(struct mytek_chip *chip)
 {
 	struct comm_runtime *rt = chip->comm;
+	int i;
 
-	if (rt)
+	if (rt) {
 		usb_poison_urb(&rt->receiver);
+		for (i = 0; i < COMM_N_URBS; i++)
+			usb_poison_urb(&rt->cmds[i].instance);
+		mytek_comm_invalidate(rt);
+		wake_up(&rt->wait);
+	}
 }
 
 void mytek_comm_destroy(struct mytek_chip *chip)
 {
 	struct comm_runtime *rt = chip->comm;
 
+	mytek_comm_cmds_destroy(rt);
 	kfree(rt->receiver_buffer);
 	kfree(rt);
 	chip->comm = NULL;
@@ -20,6 +20,34 @@
 enum /* settings for comm */
 {
 	COMM_RECEIVER_BUFSIZE = 64,
+	COMM_N_URBS = 16,	/* commands in flight */
+	COMM_N_READS = 4,	/* register reads waiting for a response */
+	COMM_READ_TIMEOUT = 50,	/* ms to wait for a response */
+	COMM_MAX_MESSAGE = 13,	/* maximum length of a command */
+	COMM_N_REGS = 0x80,	/* registers 0x80 and up are read requests */
+	COMM_N_GPIOS = 16,
+	/* shadow: registers, then gpio requests 0x20, 0x21 and 0x22 */
+	COMM_N_SHADOW = COMM_N_REGS + 3 * COMM_N_GPIOS
+};
+
+struct comm_urb {
+	struct comm_runtime *rt;
+	struct urb instance;
+	u8 *buffer;
+	u8 cmdid;
+	bool busy;	/* submitted, not yet completed */
+	int shadow;	/* index in comm_runtime.shadow, -1 if uncached */
+};
+
+/* a register read waiting for the device's response */
+struct comm_read {
+	u8 cmdid;
+	u8 reg;		/* read request, register | 0x80 */
+	bool busy;	/* slot claimed by a reader */
+	bool pending;	/* request queued, cmdid valid */
+	bool done;	/* response received */
+	u8 vl;
+	u8 vh;
 };
 
 struct comm_runtime {
@@ -28,16 +56,41 @@ struct comm_runtime {
 	struct urb receiver;
 	u8 *receiver_buffer;
 
+	/* preallocated command urbs, queued on the interrupt out endpoint */
+	struct comm_urb cmds[COMM_N_URBS];
+	spinlock_t lock;
+	wait_queue_head_t wait;
+	int n_busy;	/* commands in flight */
+	int error;	/* first error since last flush */
+
+	struct comm_read reads[COMM_N_READS];
+	bool answered;		/* device responded to a read */
+	bool no_response;	/* device never responded, reads unsupported */
+
+	/* last value written to every register/gpio, COMM_SHADOW_VALID set
+	 * if known. Writes matching the shadow are not sent. */
+	u32 shadow[COMM_N_SHADOW];
+
 	u8 serial;	/* urb serial */
 
 	u8 cmdid;	/* Unique id for issuing cmd and tracking responses */
 
 	void (*init_urb)(struct comm_runtime *rt, struct urb *urb, u8 *buffer,
 			void *context, void(*handler)(struct urb *urb));
-	/* writes control data to the device */
+	/* queue control data for the device, returns without waiting */
 	int (*write8)(struct comm_runtime *rt, u8 request, u8 reg, u8 value);
 	int (*write16)(struct comm_runtime *rt, u8 request, u8 reg,
 			u8 vh, u8 vl);
+	/* read a register, waits for the response. -EOPNOTSUPP if the
+	 * device does not answer reads */
+	int (*read16)(struct comm_runtime *rt, u8 reg, u8 *vl, u8 *vh);
+	/* wait until all queued writes are done, returns first error */
+	int (*flush)(struct comm_runtime *rt);
+	/* true if the device already holds this value */
+	bool (*is_cached)(struct comm_runtime *rt, u8 request, u8 reg,
+			u8 vl, u8 vh);
+	/* forget the shadow, e.g. when the device state is unknown */
+	void (*invalidate)(struct comm_runtime *rt);
 
 };
 
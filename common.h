@@ -26,5 +26,6 @@ struct mytek_chip;
 struct pcm_runtime;
 struct control_runtime;
 struct comm_runtime;
+struct compr_runtime;
 #endif /* MYTEK_COMMON_H */
 
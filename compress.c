@@ -0,0 +1,575 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Compress offload device for DSF/DFF playback
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/bitrev.h>
+#include <linux/uaccess.h>
+#include <linux/vmalloc.h>
+
+#include "compress.h"
+#include "chip.h"
+#include "pcm.h"
+
+#if IS_ENABLED(CONFIG_SND_COMPRESS_OFFLOAD) && defined(MYTEK_PACK_DSD)
+#include <sound/compress_driver.h>
+
+/*
+ * The player copies DSF or DFF payload, the driver keeps it in a ring in
+ * DFF layout (DSD_U8: one byte per channel and frame, msb first). DSF
+ * blocks are collected per block group (one block per channel) in copy,
+ * then bit reversed and interleaved into the ring. The in urb handler
+ * packs the ring to DoP with the DSD_U8 packer, while no pcm substream
+ * is open (see mytek_pcm_source_open).
+ */
+
+enum {
+	COMPR_DOP_RATE = 176400,
+	COMPR_MIN_FRAGMENT = 4096, COMPR_MAX_FRAGMENT = 64 * 1024,
+	COMPR_MIN_FRAGMENTS = 2, COMPR_MAX_FRAGMENTS = 256,
+	COMPR_MAX_BUFSIZE = 1024 * 1024
+};
+
+struct compr_runtime {
+	struct mytek_chip *chip;
+	struct snd_compr instance;
+	struct snd_compr_stream *stream; /* open stream, if any */
+
+	spinlock_t lock;
+	bool active; /* started and not paused */
+	bool draining;
+	bool partial_drain; /* signal the track end, keep playing */
+	u64 track_end; /* copied when the partial drain started */
+	bool packing; /* the source packs with the lock dropped */
+	bool dop_idle; /* packer set up: DoP silence while nothing plays */
+	struct snd_codec codec;
+	struct pcm_packer packer; /* DSD_U8 to DoP */
+
+	u8 *buffer; /* ring in DFF layout */
+	unsigned int buffer_bytes;
+	unsigned int fragment_bytes;
+	unsigned int fragment_off; /* bytes played in current fragment */
+	unsigned int write_off; /* ring offset copy writes to */
+	unsigned int ring_pos; /* packer frames, next to play */
+	u64 copied; /* bytes written to the ring */
+	u64 played; /* bytes packed into out urbs */
+
+	u8 *stage; /* DSF: block group being collected */
+	unsigned int stage_bytes; /* channels * COMPR_DSF_BLOCK */
+	unsigned int stage_fill;
+};
+
+/* out urb source, called from the filling context without the playback
+ * lock (see mytek_pcm_fill). Packs with its own lock dropped, like the
+ * pcm substream, and calls into the compress core with no lock held */
+static bool mytek_compr_source(struct pcm_runtime *pcm, struct pcm_urb *urb)
+{
+	struct compr_runtime *rt = pcm->chip->compr;
+	struct pack_ring ring;
+	unsigned long flags;
+	unsigned int frames = 0;
+	unsigned int bytes;
+	bool elapsed = false;
+	bool drained = false;
+	bool dop;
+	u8 *dest = urb->buffer;
+	int i;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	if (!rt->active)
+		goto idle;
+
+	for (i = 0; i < pcm->n_packets; i++)
+		frames += mytek_pcm_out_frames(pcm, urb->packets[i].length);
+	bytes = frames * rt->packer.frame_bytes;
+
+	/* partial drain: the track ends within this urb. Tell the core now,
+	 * the next track is then copied in time to follow without a gap */
+	if (rt->partial_drain && rt->played + bytes > rt->track_end) {
+		rt->partial_drain = false;
+		drained = true;
+	}
+
+	/* not enough data: silence. When draining, the rest is shorter
+	 * than an urb and dropped */
+	if (rt->copied - rt->played < bytes) {
+		if (rt->draining) {
+			rt->played = rt->copied;
+			rt->draining = false;
+			rt->active = false;
+			drained = true;
+		}
+		goto idle;
+	}
+
+	ring.area = rt->buffer;
+	ring.size = rt->buffer_bytes / rt->packer.frame_bytes;
+	ring.pos = rt->ring_pos;
+	rt->packing = true;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	mytek_pack_begin(&rt->packer);
+	for (i = 0; i < pcm->n_packets; i++)
+		dest = mytek_pack_packet(&rt->packer, dest,
+				mytek_pcm_out_frames(pcm,
+					urb->packets[i].length), &ring);
+	mytek_pack_end(&rt->packer);
+
+	spin_lock_irqsave(&rt->lock, flags);
+	rt->packing = false;
+	rt->ring_pos = ring.pos;
+	rt->played += bytes;
+
+	rt->fragment_off += bytes;
+	if (rt->fragment_off >= rt->fragment_bytes) {
+		rt->fragment_off %= rt->fragment_bytes;
+		elapsed = true;
+	}
+	urb->frames = 0;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	if (elapsed)
+		snd_compr_fragment_elapsed(rt->stream);
+	if (drained)
+		snd_compr_drain_notify(rt->stream);
+	return true;
+
+idle:
+	/* keep the dac in DSD mode, the packer is not in use here */
+	dop = rt->dop_idle;
+	if (dop)
+		mytek_pcm_dop_silence(pcm, &rt->packer, urb);
+	spin_unlock_irqrestore(&rt->lock, flags);
+	if (drained)
+		snd_compr_drain_notify(rt->stream);
+	return dop;
+}
+
+/* in stereo mode the out endpoint has 2 slots */
+static unsigned int mytek_compr_max_channels(struct compr_runtime *rt)
+{
+	return mytek_pack_out_slots(rt->chip->stereo);
+}
+
+/* process context. Stops the source and waits until it no longer reads
+ * the ring */
+static void mytek_compr_reset(struct compr_runtime *rt)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	rt->active = false;
+	while (rt->packing) {
+		spin_unlock_irqrestore(&rt->lock, flags);
+		cpu_relax();
+		spin_lock_irqsave(&rt->lock, flags);
+	}
+	rt->draining = false;
+	rt->partial_drain = false;
+	rt->fragment_off = 0;
+	rt->write_off = 0;
+	rt->ring_pos = 0;
+	rt->copied = 0;
+	rt->played = 0;
+	rt->stage_fill = 0;
+	spin_unlock_irqrestore(&rt->lock, flags);
+}
+
+/* a stopped stream keeps sending DoP silence until its setup changes */
+static void mytek_compr_clear_idle(struct compr_runtime *rt)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	rt->dop_idle = false;
+	spin_unlock_irqrestore(&rt->lock, flags);
+}
+
+static void mytek_compr_free_buffers(struct compr_runtime *rt)
+{
+	vfree(rt->buffer);
+	kfree(rt->stage);
+	rt->buffer = NULL;
+	rt->stage = NULL;
+}
+
+static int mytek_compr_open(struct snd_compr_stream *stream)
+{
+	struct compr_runtime *rt = stream->private_data;
+	int ret;
+
+	if (rt->chip->shutdown || !rt->chip->pcm)
+		return -ENODEV;
+
+	ret = mytek_pcm_source_open(rt->chip->pcm, mytek_compr_source);
+	if (ret < 0)
+		return ret;
+
+	mytek_compr_reset(rt);
+	rt->stream = stream;
+	return 0;
+}
+
+static int mytek_compr_free(struct snd_compr_stream *stream)
+{
+	struct compr_runtime *rt = stream->private_data;
+
+	/* after this the source no longer touches the ring */
+	mytek_compr_reset(rt);
+	mytek_compr_clear_idle(rt);
+	if (rt->chip->pcm)
+		mytek_pcm_source_close(rt->chip->pcm);
+	mytek_compr_free_buffers(rt);
+	rt->stream = NULL;
+	return 0;
+}
+
+static int mytek_compr_set_params(struct snd_compr_stream *stream,
+		struct snd_compr_params *params)
+{
+	struct compr_runtime *rt = stream->private_data;
+	struct snd_codec *codec = &params->codec;
+	unsigned int fragment = params->buffer.fragment_size;
+	unsigned int fragments = params->buffer.fragments;
+	unsigned int bytes;
+
+	if (codec->id != SND_AUDIOCODEC_BESPOKE
+			|| (codec->format != COMPR_FORMAT_DSF
+			&& codec->format != COMPR_FORMAT_DFF)
+			|| codec->ch_in < 1
+			|| codec->ch_in > mytek_compr_max_channels(rt)
+			|| (codec->sample_rate
+			&& codec->sample_rate != COMPR_RATE))
+		return -EINVAL;
+
+	if (fragment < COMPR_MIN_FRAGMENT || fragment > COMPR_MAX_FRAGMENT
+			|| fragments < COMPR_MIN_FRAGMENTS
+			|| fragments > COMPR_MAX_FRAGMENTS)
+		return -EINVAL;
+	bytes = fragment * fragments;
+	/* whole DoP frames, room for a DSF block group */
+	if (bytes > COMPR_MAX_BUFSIZE || bytes % (codec->ch_in << 1)
+			|| (codec->format == COMPR_FORMAT_DSF
+			&& bytes < codec->ch_in * COMPR_DSF_BLOCK))
+		return -EINVAL;
+
+	mytek_compr_free_buffers(rt);
+	rt->buffer = vmalloc(bytes);
+	if (!rt->buffer)
+		return -ENOMEM;
+	rt->stage_bytes = 0;
+	if (codec->format == COMPR_FORMAT_DSF) {
+		rt->stage_bytes = codec->ch_in * COMPR_DSF_BLOCK;
+		rt->stage = kmalloc(rt->stage_bytes, GFP_KERNEL);
+		if (!rt->stage) {
+			mytek_compr_free_buffers(rt);
+			return -ENOMEM;
+		}
+	}
+
+	rt->codec = *codec;
+	rt->buffer_bytes = bytes;
+	rt->fragment_bytes = fragment;
+	mytek_compr_reset(rt);
+	/* the packer is set up again at start */
+	mytek_compr_clear_idle(rt);
+	return 0;
+}
+
+static int mytek_compr_get_params(struct snd_compr_stream *stream,
+		struct snd_codec *params)
+{
+	struct compr_runtime *rt = stream->private_data;
+
+	*params = rt->codec;
+	return 0;
+}
+
+static int mytek_compr_trigger(struct snd_compr_stream *stream, int cmd)
+{
+	struct compr_runtime *rt = stream->private_data;
+	struct pcm_runtime *pcm = rt->chip->pcm;
+	unsigned long flags;
+	int ret;
+
+	if (rt->chip->shutdown || !pcm)
+		return -ENODEV;
+
+	switch (cmd) {
+	case SNDRV_PCM_TRIGGER_START:
+		/* packer first, a bad setup must not leave the device
+		 * streaming. The source may send DoP silence with the old
+		 * packer meanwhile */
+		spin_lock_irqsave(&rt->lock, flags);
+		ret = mytek_pack_init(&rt->packer, SNDRV_PCM_FORMAT_DSD_U8,
+				rt->codec.ch_in, mytek_pcm_out_channels(pcm));
+		spin_unlock_irqrestore(&rt->lock, flags);
+		if (ret < 0)
+			return ret;
+		ret = mytek_pcm_source_start(pcm, COMPR_DOP_RATE);
+		if (ret < 0)
+			return ret;
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->dop_idle = true;
+		rt->active = true;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->active = true;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_STOP:
+		/* the core forgets all data, so do we */
+		mytek_compr_reset(rt);
+		return 0;
+
+	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->active = false;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		return 0;
+
+	/* play what is in the ring, a partial DSF block group is dropped */
+	case SND_COMPR_TRIGGER_DRAIN:
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->draining = true;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		return 0;
+
+	/* gapless: keep playing, the source signals when the data copied
+	 * so far is about to run out */
+	case SND_COMPR_TRIGGER_PARTIAL_DRAIN:
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->track_end = rt->copied;
+		rt->partial_drain = true;
+		spin_unlock_irqrestore(&rt->lock, flags);
+		return 0;
+
+	/* the current track is copied completely. Its last DSF block group
+	 * is incomplete, drop it so the next track starts on a block */
+	case SND_COMPR_TRIGGER_NEXT_TRACK:
+		rt->stage_fill = 0;
+		return 0;
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int mytek_compr_pointer(struct snd_compr_stream *stream,
+		struct snd_compr_tstamp *tstamp)
+{
+	struct compr_runtime *rt = stream->private_data;
+	unsigned long flags;
+	unsigned int frame_bytes = rt->codec.ch_in << 1;
+
+	spin_lock_irqsave(&rt->lock, flags);
+	tstamp->byte_offset = rt->ring_pos * frame_bytes;
+	tstamp->copied_total = rt->played;
+	tstamp->pcm_frames = div_u64(rt->played, frame_bytes);
+	tstamp->pcm_io_frames = tstamp->pcm_frames;
+	tstamp->sampling_rate = COMPR_DOP_RATE;
+	spin_unlock_irqrestore(&rt->lock, flags);
+
+	return 0;
+}
+
+/* DSF block group in the stage: bit reverse and interleave into the ring */
+static void mytek_compr_interleave(struct compr_runtime *rt)
+{
+	unsigned int channels = rt->codec.ch_in;
+	unsigned int off = rt->write_off;
+	unsigned int i;
+	unsigned int c;
+
+	for (i = 0; i < COMPR_DSF_BLOCK; i++)
+		for (c = 0; c < channels; c++) {
+			rt->buffer[off] = bitrev8(rt->stage[c * COMPR_DSF_BLOCK
+					+ i]);
+			if (++off == rt->buffer_bytes)
+				off = 0;
+		}
+	rt->write_off = off;
+}
+
+static int mytek_compr_copy(struct snd_compr_stream *stream,
+		char __user *buf, size_t count)
+{
+	struct compr_runtime *rt = stream->private_data;
+	unsigned long flags;
+	size_t done = 0;
+	size_t n;
+
+	if (!rt->buffer)
+		return -EINVAL;
+
+	while (done < count) {
+		if (rt->stage) {
+			n = min_t(size_t, count - done,
+					rt->stage_bytes - rt->stage_fill);
+			if (copy_from_user(rt->stage + rt->stage_fill,
+						buf + done, n))
+				return -EFAULT;
+			done += n;
+			rt->stage_fill += n;
+			if (rt->stage_fill < rt->stage_bytes)
+				break;
+			mytek_compr_interleave(rt);
+			n = rt->stage_bytes;
+			rt->stage_fill = 0;
+		} else {
+			n = min_t(size_t, count - done,
+					rt->buffer_bytes - rt->write_off);
+			if (copy_from_user(rt->buffer + rt->write_off,
+						buf + done, n))
+				return -EFAULT;
+			done += n;
+			rt->write_off += n;
+			if (rt->write_off == rt->buffer_bytes)
+				rt->write_off = 0;
+		}
+
+		/* publish to the source */
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->copied += n;
+		spin_unlock_irqrestore(&rt->lock, flags);
+	}
+	return count;
+}
+
+static int mytek_compr_get_caps(struct snd_compr_stream *stream,
+		struct snd_compr_caps *caps)
+{
+	caps->direction = SND_COMPRESS_PLAYBACK;
+	caps->min_fragment_size = COMPR_MIN_FRAGMENT;
+	caps->max_fragment_size = COMPR_MAX_FRAGMENT;
+	caps->min_fragments = COMPR_MIN_FRAGMENTS;
+	caps->max_fragments = COMPR_MAX_FRAGMENTS;
+	caps->num_codecs = 1;
+	caps->codecs[0] = SND_AUDIOCODEC_BESPOKE;
+	return 0;
+}
+
+static int mytek_compr_get_codec_caps(struct snd_compr_stream *stream,
+		struct snd_compr_codec_caps *codec)
+{
+	struct compr_runtime *rt = stream->private_data;
+
+	if (codec->codec != SND_AUDIOCODEC_BESPOKE)
+		return -EINVAL;
+
+	codec->num_descriptors = 1;
+	codec->descriptor[0].max_ch = mytek_compr_max_channels(rt);
+	codec->descriptor[0].sample_rates[0] = COMPR_RATE;
+	codec->descriptor[0].num_sample_rates = 1;
+	codec->descriptor[0].formats = 1 << COMPR_FORMAT_DSF
+			| 1 << COMPR_FORMAT_DFF;
+	return 0;
+}
+
+static struct snd_compr_ops compr_ops = {
+	.open = mytek_compr_open,
+	.free = mytek_compr_free,
+	.set_params = mytek_compr_set_params,
+	.get_params = mytek_compr_get_params,
+	.trigger = mytek_compr_trigger,
+	.pointer = mytek_compr_pointer,
+	.copy = mytek_compr_copy,
+	.get_caps = mytek_compr_get_caps,
+	.get_codec_caps = mytek_compr_get_codec_caps,
+};
+
+/* the snd_compr lives until the card is freed, so does the runtime */
+static int mytek_compr_dev_free(struct snd_device *device)
+{
+	struct compr_runtime *rt = device->device_data;
+
+	mytek_compr_free_buffers(rt);
+	kfree(rt);
+	return 0;
+}
+
+static struct snd_device_ops compr_dev_ops = {
+	.dev_free = mytek_compr_dev_free,
+};
+
+int mytek_compr_init(struct mytek_chip *chip)
+{
+	int ret;
+	struct compr_runtime *rt = kzalloc(sizeof(struct compr_runtime),
+			GFP_KERNEL);
+
+	if (!rt)
+		return -ENOMEM;
+
+	rt->chip = chip;
+	spin_lock_init(&rt->lock);
+	rt->instance.ops = &compr_ops;
+	rt->instance.private_data = rt;
+
+	ret = snd_device_new(chip->card, SNDRV_DEV_LOWLEVEL, rt,
+			&compr_dev_ops);
+	if (ret < 0) {
+		kfree(rt);
+		return ret;
+	}
+	chip->compr = rt;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 7, 0)
+	ret = snd_compress_new(chip->card, 0, SND_COMPRESS_PLAYBACK,
+			&rt->instance);
+#else
+	ret = snd_compress_new(chip->card, 0, SND_COMPRESS_PLAYBACK,
+			"MytekUSB2 DSD", &rt->instance);
+#endif
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "cannot create compress instance.\n");
+		return ret;
+	}
+	return 0;
+}
+
+void mytek_compr_abort(struct mytek_chip *chip)
+{
+	struct compr_runtime *rt = chip->compr;
+	unsigned long flags;
+
+	if (rt) {
+		spin_lock_irqsave(&rt->lock, flags);
+		rt->active = false;
+		spin_unlock_irqrestore(&rt->lock, flags);
+	}
+}
+
+/* freed with the card, see mytek_compr_dev_free */
+void mytek_compr_destroy(struct mytek_chip *chip)
+{
+	chip->compr = NULL;
+}
+#else
+int mytek_compr_init(struct mytek_chip *chip)
+{
+	return 0;
+}
+
+void mytek_compr_abort(struct mytek_chip *chip)
+{
+}
+
+void mytek_compr_destroy(struct mytek_chip *chip)
+{
+}
+#endif
@@ -0,0 +1,37 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MYTEK_COMPRESS_H
+#define MYTEK_COMPRESS_H
+
+#include "common.h"
+
+/*
+ * snd_codec of the compress device: id SND_AUDIOCODEC_BESPOKE, format
+ * one of COMPR_FORMAT_XXX, ch_in the channel count, sample_rate 2822400
+ * (DSD64) or 0. Payload only, the player strips the container headers.
+ */
+enum {
+	COMPR_FORMAT_DSF = 1,	/* per channel blocks of COMPR_DSF_BLOCK, lsb first */
+	COMPR_FORMAT_DFF = 2	/* bytes interleaved per channel, msb first */
+};
+
+enum {
+	COMPR_DSF_BLOCK = 4096,	/* bytes per channel and DSF block */
+	COMPR_RATE = 2822400	/* DSD64, sent as DoP at 176.4k */
+};
+
+int mytek_compr_init(struct mytek_chip *chip);
+void mytek_compr_abort(struct mytek_chip *chip);
+void mytek_compr_destroy(struct mytek_chip *chip);
+#endif /* MYTEK_COMPRESS_H */
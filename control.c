@@ -61,6 +61,43 @@ static const int rates_altsetting[] = { 1, 1, 2, 2, 3, 3 };
 static const u16 rates_mytek_vl[] = {0x00, 0x01, 0x00, 0x01, 0x00, 0x01};
 static const u16 rates_mytek_vh[] = {0x11, 0x11, 0x10, 0x10, 0x00, 0x00};
 
+/*
+ * Read a register back after writing it. The response layout is not
+ * documented (see mytek_comm_read16), so a failed or differing read only
+ * gets a warning, once, and the caller falls back to the fixed delay.
+ * Make it fatal only once the layout is verified on hardware. Compares
+ * the bits in mask of vh << 8 | vl. True if the device confirmed.
+ */
+static bool mytek_control_read_back(struct control_runtime *rt, u8 reg,
+		u8 vl, u8 vh, u16 mask)
+{
+	struct comm_runtime *comm_rt = rt->chip->comm;
+	u8 rvl;
+	u8 rvh;
+	int ret;
+
+	ret = comm_rt->read16(comm_rt, reg, &rvl, &rvh);
+	if (ret == -EOPNOTSUPP)
+		return false;
+	if (!ret && !(((rvh << 8 | rvl) ^ (vh << 8 | vl)) & mask))
+		return true;
+
+	if (!rt->read_back_warned) {
+		if (ret < 0)
+			dev_warn(&rt->chip->dev->dev,
+				"register %02x read back failed (%d), using fixed delays.\n",
+				reg, ret);
+		else
+			dev_warn(&rt->chip->dev->dev,
+				"register %02x reads %02x%02x, not %02x%02x, using fixed delays.\n",
+				reg, rvh, rvl, vh, vl);
+		rt->read_back_warned = true;
+	}
+	/* do not skip the next write of it */
+	comm_rt->invalidate(comm_rt);
+	return false;
+}
+
 static int mytek_control_set_rate(struct control_runtime *rt, int rate)
 {
 	int ret;
@@ -70,6 +107,15 @@ static int mytek_control_set_rate(struct control_runtime *rt, int rate)
 	if (rate < 0 || rate >= CONTROL_N_RATES)
 		return -EINVAL;
 
+	/* device already runs at this rate, nothing to reprogram */
+	if (rt->altsetting == rates_altsetting[rate]
+			&& comm_rt->is_cached(comm_rt, 0x02, 0x01,
+				rates_mytek_vl[rate], rates_mytek_vh[rate])
+			&& comm_rt->is_cached(comm_rt, 0x02, 0x05, 0x00,
+				rt->out_sample_delay))
+		return 0;
+
+	rt->altsetting = 0;
 	ret = usb_set_interface(device, 1, rates_altsetting[rate]);
 	if (ret < 0) {
 		dev_err(&rt->chip->dev->dev,
@@ -90,15 +136,55 @@ static int mytek_control_set_rate(struct control_runtime *rt, int rate)
 	}
 
 	comm_rt->write16(comm_rt, 0x02, 0x00, 0x00, 0x00);	/* Disable streaming */
-	comm_rt->write16(comm_rt, 0x02, 0x05, 0x00, 0x00);	/* Set out sample delay to 0 */
+	comm_rt->write16(comm_rt, 0x02, 0x05, 0x00, rt->out_sample_delay);	/* Set out sample delay */
 	comm_rt->write16(comm_rt, 0x02, 0x02, 0x07, 0x07);	/* Enable all I2S I and O */
 	comm_rt->write16(comm_rt, 0x02, 0x04, 0x00, 0x06);	/* Enable DSD */
 	comm_rt->write16(comm_rt, 0x02, 0x03, 0x00, 0x00);	/* Disable SPDIF O and I */
 	comm_rt->write16(comm_rt, 0x02, 0x09, 0x00, 0x01);	/* Set mystery reg 9 to 1 */
 	comm_rt->write8(comm_rt, 0x22, 0x00, 0x01);		/* Set GPIO pin 0 to high state */
 
-	msleep(15);		/* Let the Mytek's display catch up with the new rate */
+	/* one barrier for the whole batch */
+	ret = comm_rt->flush(comm_rt);
+	if (ret < 0) {
+		dev_err(&rt->chip->dev->dev,
+			"mytek_control_set_rate: setting rate failed\n");
+		return ret;
+	}
+
+	/* wait for the device to confirm the new clock */
+	if (!mytek_control_read_back(rt, 0x01, rates_mytek_vl[rate],
+				rates_mytek_vh[rate], 0xffff))
+		msleep(15);	/* Let the Mytek's display catch up with the new rate */
 
+	rt->altsetting = rates_altsetting[rate];
+	return 0;
+}
+
+/*
+ * Rate pairs 44.1/48k, 88.2/96k and 176.4/192k share altsetting and
+ * packet sizes. Switching within a pair only needs the clock register,
+ * the urbs keep running and follow the new rate through the implicit
+ * feedback.
+ */
+static int mytek_control_set_clock(struct control_runtime *rt, int rate)
+{
+	int ret;
+	struct comm_runtime *comm_rt = rt->chip->comm;
+
+	if (rate < 0 || rate >= CONTROL_N_RATES
+			|| rt->altsetting != rates_altsetting[rate])
+		return -EINVAL;
+
+	ret = comm_rt->write16(comm_rt, 0x02, 0x01, rates_mytek_vl[rate],
+			rates_mytek_vh[rate]);
+	if (ret < 0)
+		return ret;
+	ret = comm_rt->flush(comm_rt);
+	if (ret < 0)
+		return ret;
+
+	mytek_control_read_back(rt, 0x01, rates_mytek_vl[rate],
+			rates_mytek_vh[rate], 0xffff);
 	return 0;
 }
 
@@ -109,14 +195,17 @@ static int mytek_control_set_channels(
 	int ret;
 	struct comm_runtime *comm_rt = rt->chip->comm;
 
-	/* Enable USBPAL I2S Inputs and Outputs
+	/* Enable USBPAL I2S Inputs and Outputs, one bit per line of
+	 * 2 channels: 6 out and 4 in gives 0x07 and 0x03.
 	 *
 	 * The windows driver enables all IS2 Inputs and Outputs
 	 * If we do that here, output gets noisy. For now only
 	 * enable I2S_I 2,1 and 0.
 	 * TODO: Fix/verify
 	 */
-	ret = comm_rt->write16(comm_rt, 0x02, 0x02, 0x07, 0x03);
+	ret = comm_rt->write16(comm_rt, 0x02, 0x02,
+			(1 << DIV_ROUND_UP(n_analog_out, 2)) - 1,
+			(1 << DIV_ROUND_UP(n_analog_in, 2)) - 1);
 
 	if (ret < 0)
 		return ret;
@@ -126,18 +215,31 @@ static int mytek_control_set_channels(
 	if (ret < 0)
 		return ret;
 
-	return 0;
+	return comm_rt->flush(comm_rt);
 }
 
 static int mytek_control_streaming_update(struct control_runtime *rt)
 {
 	struct comm_runtime *comm_rt = rt->chip->comm;
+	u8 on = rt->usb_streaming ? 0x01 : 0x00;
+	int ret;
 
 	if (comm_rt) {
 
-		return comm_rt->write16(comm_rt, 0x02, 0x00, 0x00,
-			(rt->usb_streaming ? 0x01 : 0x00) );
+		if (comm_rt->is_cached(comm_rt, 0x02, 0x00, 0x00, on))
+			return 0;
 
+		ret = comm_rt->write16(comm_rt, 0x02, 0x00, 0x00, on);
+		if (ret < 0)
+			return ret;
+
+		ret = comm_rt->flush(comm_rt);
+		if (ret < 0)
+			return ret;
+
+		/* only the enable bit, the rest may be status */
+		mytek_control_read_back(rt, 0x00, 0x00, on, 0x0100);
+		return 0;
 	}
 	return -EINVAL;
 }
@@ -145,6 +247,8 @@ static int mytek_control_streaming_update(struct control_runtime *rt)
 int mytek_control_init(struct mytek_chip *chip)
 {
 	int i;
+	int ret = 0;
+	int err;
 	struct control_runtime *rt = kzalloc(sizeof(struct control_runtime),
 			GFP_KERNEL);
 	struct comm_runtime *comm_rt = chip->comm;
@@ -155,26 +259,38 @@ int mytek_control_init(struct mytek_chip *chip)
 	rt->chip = chip;
 	rt->update_streaming = mytek_control_streaming_update;
 	rt->set_rate = mytek_control_set_rate;
+	rt->set_clock = mytek_control_set_clock;
 	rt->set_channels = mytek_control_set_channels;
 
 	i = 0;
 
-	while (init_data_mytek[i].type) {
+	while (init_data_mytek[i].type && ret >= 0) {
 
 		if (init_data_mytek[i].type != 0x02) {
-			comm_rt->write8(comm_rt, init_data_mytek[i].type,
+			ret = comm_rt->write8(comm_rt, init_data_mytek[i].type,
 					init_data_mytek[i].reg,
 					init_data_mytek[i].valh);
 		} else {
-			comm_rt->write16(comm_rt, init_data_mytek[i].type,
+			ret = comm_rt->write16(comm_rt, init_data_mytek[i].type,
 					 init_data_mytek[i].reg,
 					 init_data_mytek[i].valh,
 					 init_data_mytek[i].vall);
-		}	
+		}
 		i++;
 	}
 
-	mytek_control_streaming_update(rt);
+	/* the streaming register is cached by now, so the update below
+	 * does not flush: wait for the batch here and collect its errors */
+	err = comm_rt->flush(comm_rt);
+	if (ret >= 0)
+		ret = err;
+	if (ret >= 0)
+		ret = mytek_control_streaming_update(rt);
+	if (ret < 0) {
+		dev_err(&chip->dev->dev, "error initializing device.\n");
+		kfree(rt);
+		return ret;
+	}
 	chip->control = rt;
 
 	return 0;
@@ -35,12 +35,18 @@ enum {
 struct control_runtime {
 	int (*update_streaming)(struct control_runtime *rt);
 	int (*set_rate)(struct control_runtime *rt, int rate);
+	/* switch clock only, while streaming. -EINVAL if the rate needs
+	 * another altsetting (then use set_rate) */
+	int (*set_clock)(struct control_runtime *rt, int rate);
 	int (*set_channels)(struct control_runtime *rt, int n_analog_out,
 		int n_analog_in, bool spdif_out, bool spdif_in);
 
 	struct mytek_chip *chip;
 
 	bool usb_streaming;
+	u8 out_sample_delay; /* register 0x05, output delay in samples */
+	int altsetting; /* current altsetting of interface 1, 0 if unknown */
+	bool read_back_warned; /* see mytek_control_read_back */
 
 };
 
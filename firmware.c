@@ -28,7 +28,8 @@ MODULE_FIRMWARE("mytek/mytekap.ihx");
 MODULE_FIRMWARE("mytek/mytekcf.bin");
 
 enum {
-	FPGA_BUFSIZE = 512, FPGA_EP = 2
+	FPGA_BUFSIZE = 512, FPGA_EP = 2,
+	PCM_INTF = 1, PCM_OUT_EP = 6 /* OUT_EP in pcm.c */
 };
 
 /*
@@ -44,6 +45,13 @@ static const u8 ep_w_max_packet_size[] = {
 	0x94, 0x01, 0x5c, 0x02  /* alt 3: 404 EP2 and 604 EP6 (25 fpp) */
 };
 
+/* same for stereo mode, EP6 carries 2 channels */
+static const u8 ep_w_max_packet_size_stereo[] = {
+	0xe4, 0x00, 0x3c, 0x00, /* alt 1: 228 EP2 and 60 EP6 (7 fpp) */
+	0xa4, 0x01, 0x6c, 0x00, /* alt 2: 420 EP2 and 108 EP6 (13 fpp)*/
+	0x94, 0x01, 0xcc, 0x00  /* alt 3: 404 EP2 and 204 EP6 (25 fpp) */
+};
+
 static const u8 known_fw_versions[][4] = {
 	{ 0x03, 0x01, 0x23, 0x16 },	/* Windows fw 1.35.22 for Mytek firmware 1.81.1 */
 	{ 0x03, 0x01, 0x22, 0x0a },	/* Windows fw 1.34.10 for Mytek firmware 1.7.5b1 */
@@ -359,7 +367,35 @@ static int mytek_fw_check(struct usb_interface *intf, const u8 *version)
 	return -EINVAL;
 }
 
-int mytek_fw_init(struct usb_interface *intf)
+/*
+ * The endpoint sizes are set at firmware upload and stay until the dac
+ * loses power, so the running firmware decides, not the module parameter.
+ * Returns 1 if EP6 is sized for stereo, 0 if for 6 channels.
+ */
+int mytek_fw_stereo(struct usb_interface *intf)
+{
+	struct usb_device *device = interface_to_usbdev(intf);
+	struct usb_interface *pcm_intf = usb_ifnum_to_if(device, PCM_INTF);
+	struct usb_host_interface *alt = NULL;
+	struct usb_endpoint_descriptor *ep;
+	int i;
+
+	if (pcm_intf)
+		alt = usb_altnum_to_altsetting(pcm_intf, 1);
+	for (i = 0; alt && i < alt->desc.bNumEndpoints; i++) {
+		ep = &alt->endpoint[i].desc;
+		if (usb_endpoint_num(ep) == PCM_OUT_EP
+				&& usb_endpoint_dir_out(ep))
+			return usb_endpoint_maxp(ep) ==
+					(ep_w_max_packet_size_stereo[2]
+					| ep_w_max_packet_size_stereo[3] << 8);
+	}
+
+	dev_err(&intf->dev, "no pcm out endpoint found.\n");
+	return -ENODEV;
+}
+
+int mytek_fw_init(struct usb_interface *intf, bool stereo)
 {
 	int i;
 	int ret;
@@ -417,7 +453,9 @@ int mytek_fw_init(struct usb_interface *intf)
 			return ret;
 		}
 
-		memcpy(buffer, ep_w_max_packet_size,
+		/* the endpoint sizes stay until the dac loses power */
+		memcpy(buffer, stereo ? ep_w_max_packet_size_stereo
+				: ep_w_max_packet_size,
 				sizeof(ep_w_max_packet_size));
 		ret = mytek_fw_ezusb_upload(intf, "mytek/mytekap.ihx",
 				0x0003,	buffer, sizeof(ep_w_max_packet_size));
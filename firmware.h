@@ -24,6 +24,7 @@ enum /* firmware state of device */
 	FW_NOT_READY = 1
 };
 
-int mytek_fw_init(struct usb_interface *intf);
+int mytek_fw_init(struct usb_interface *intf, bool stereo);
+int mytek_fw_stereo(struct usb_interface *intf);
 #endif /* MYTEK_FIRMWARE_H */
 
@@ -0,0 +1,508 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Out urb packer
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "pack.h"
+
+#ifdef MYTEK_PACK_SIMD
+#include <asm/simd.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#else
+#include <asm/neon.h>
+#endif
+#endif
+
+/*
+ * Layout of an out packet: a 4 byte header (0xaa 0xaa <frame count> 0x00)
+ * followed by out_slots 32 bit little endian slots per frame. Each slot
+ * carries a 24 bit sample in its lower bytes, the upper byte is the 0x40
+ * marker for analog channels. Slots without alsa data are silence.
+ * Narrower alsa samples (S16_LE, S24_3LE) are widened on the way.
+ * Alsa channel n goes to slot n, except for the routed packers that look
+ * up the channel of every slot (mono to both dac slots).
+ *
+ * Header, samples and markers are all written in a single pass, so the
+ * out buffer is touched exactly once per urb.
+ *
+ * DSD goes out as DoP: each slot carries 16 DSD bits, oldest bit first,
+ * below a DoP marker byte that alternates between 0x05 and 0xfa from
+ * frame to frame. Both markers are merged into the slot in the same pass.
+ */
+#define PACK_SLOT_SILENCE	cpu_to_le32(PACK_SLOT_MARKER)
+#define PACK_DOP_MARKER		0x05
+#define PACK_DOP_TOGGLE		(0x05 ^ 0xfa)
+#define PACK_DOP_IDLE		0x6969 /* DSD silence, two bytes */
+
+static inline __le32 mytek_pack_header(unsigned int frames)
+{
+	return cpu_to_le32(0x0000aaaa | (frames & 0xff) << 16);
+}
+
+/* S24_LE: sample in the lower 24 bits */
+static inline u32 mytek_pack_s24(const u8 *src)
+{
+	return le32_to_cpup((const __le32 *) src) & 0x00ffffff;
+}
+
+/* S32_LE: device gets the upper 24 bits */
+static inline u32 mytek_pack_s32(const u8 *src)
+{
+	return le32_to_cpup((const __le32 *) src) >> 8;
+}
+
+/* S16_LE: sample in the upper 16 of the 24 bits */
+static inline u32 mytek_pack_s16(const u8 *src)
+{
+	return (u32) le16_to_cpup((const __le16 *) src) << 8;
+}
+
+/* S24_3LE: 3 bytes, not aligned */
+static inline u32 mytek_pack_s24_3le(const u8 *src)
+{
+	return src[0] | src[1] << 8 | src[2] << 16;
+}
+
+/* width: bytes per alsa sample */
+static __always_inline void mytek_pack_frames(const struct pcm_packer *p,
+		__le32 *dest, const u8 *src, unsigned int frames,
+		unsigned int channels, unsigned int width,
+		u32 (*sample)(const u8 *src))
+{
+	unsigned int frame;
+	unsigned int slot;
+
+	for (frame = 0; frame < frames; frame++) {
+		for (slot = 0; slot < channels; slot++, src += width)
+			*(dest++) = cpu_to_le32(sample(src) | PACK_SLOT_MARKER);
+		for (; slot < p->out_slots; slot++)
+			*(dest++) = PACK_SLOT_SILENCE;
+	}
+}
+
+/* same, every slot takes the channel p->route names */
+static __always_inline void mytek_pack_routed_frames(
+		const struct pcm_packer *p, __le32 *dest, const u8 *src,
+		unsigned int frames, unsigned int width,
+		u32 (*sample)(const u8 *src))
+{
+	unsigned int stride = p->channels * width;
+	unsigned int out_slots = p->out_slots;
+	u8 route[PACK_MAX_SLOTS];
+	unsigned int frame;
+	unsigned int slot;
+
+	/* local copy, the stores to dest could alias p */
+	memcpy(route, p->route, sizeof(route));
+	for (frame = 0; frame < frames; frame++, src += stride)
+		for (slot = 0; slot < out_slots; slot++)
+			*(dest++) = route[slot] == PACK_ROUTE_NONE
+					? PACK_SLOT_SILENCE
+					: cpu_to_le32(sample(src + route[slot]
+						* width) | PACK_SLOT_MARKER);
+}
+
+/* one packer per format and channel count, so the inner loops unroll */
+#define MYTEK_PACK_VARIANT(fmt, width, ch) \
+static void mytek_pack_##fmt##_##ch(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	mytek_pack_frames(p, dest, src, frames, ch, width, \
+			mytek_pack_##fmt); \
+}
+
+#define MYTEK_PACK_VARIANTS(fmt, width) \
+static void mytek_pack_##fmt##_routed(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	mytek_pack_routed_frames(p, dest, src, frames, width, \
+			mytek_pack_##fmt); \
+} \
+MYTEK_PACK_VARIANT(fmt, width, 1) \
+MYTEK_PACK_VARIANT(fmt, width, 2) \
+MYTEK_PACK_VARIANT(fmt, width, 3) \
+MYTEK_PACK_VARIANT(fmt, width, 4) \
+MYTEK_PACK_VARIANT(fmt, width, 5) \
+MYTEK_PACK_VARIANT(fmt, width, 6) \
+static void (* const mytek_pack_##fmt##_ops[PACK_MAX_SLOTS])( \
+		const struct pcm_packer *p, __le32 *dest, \
+		const u8 *src, unsigned int frames) = { \
+	mytek_pack_##fmt##_1, mytek_pack_##fmt##_2, mytek_pack_##fmt##_3, \
+	mytek_pack_##fmt##_4, mytek_pack_##fmt##_5, mytek_pack_##fmt##_6 \
+};
+
+MYTEK_PACK_VARIANTS(s24, 4)
+MYTEK_PACK_VARIANTS(s32, 4)
+MYTEK_PACK_VARIANTS(s16, 2)
+MYTEK_PACK_VARIANTS(s24_3le, 3)
+
+#ifdef MYTEK_PACK_DSD
+/* 16 DSD bits of a channel. src is the channel's first byte in the alsa
+ * frame; DSD_U8 takes the byte of the next frame too. */
+static inline u32 mytek_pack_dsd_u8(const u8 *src, unsigned int channels,
+		bool low)
+{
+	return src[0] << 8 | src[channels];
+}
+
+static inline u32 mytek_pack_dsd_u16le(const u8 *src, unsigned int channels,
+		bool low)
+{
+	return le16_to_cpup((const __le16 *) src);
+}
+
+static inline u32 mytek_pack_dsd_u32le(const u8 *src, unsigned int channels,
+		bool low)
+{
+	u32 v = le32_to_cpup((const __le32 *) src);
+
+	return low ? v & 0xffff : v >> 16;
+}
+
+static inline u32 mytek_pack_dsd_u32be(const u8 *src, unsigned int channels,
+		bool low)
+{
+	u32 v = be32_to_cpup((const __be32 *) src);
+
+	return low ? v & 0xffff : v >> 16;
+}
+
+/* DoP frames from 8/16 bit (width 1/2) or 32 bit (width 4) DSD samples.
+ * routed: slots take the channel p->route names */
+static __always_inline void mytek_pack_dop_frames(const struct pcm_packer *p,
+		__le32 *dest, const u8 *src, unsigned int frames,
+		unsigned int channels, unsigned int width, bool routed,
+		u32 (*sample)(const u8 *src, unsigned int channels, bool low))
+{
+	u32 marker = p->dop_marker;
+	bool low = p->phase;
+	unsigned int frame;
+	unsigned int slot;
+	u32 head;
+
+	/* 32 bit: src points to the middle of the alsa frame */
+	if (width == 4 && low)
+		src -= channels << 1;
+
+	for (frame = 0; frame < frames; frame++) {
+		head = PACK_SLOT_MARKER | marker << 16;
+		if (routed) {
+			for (slot = 0; slot < p->out_slots; slot++)
+				*(dest++) = p->route[slot] == PACK_ROUTE_NONE
+						? PACK_SLOT_SILENCE
+						: cpu_to_le32(head | sample(src
+							+ p->route[slot] * width,
+							channels, low));
+		} else {
+			for (slot = 0; slot < channels; slot++)
+				*(dest++) = cpu_to_le32(head
+						| sample(src + slot * width,
+							channels, low));
+			for (; slot < p->out_slots; slot++)
+				*(dest++) = PACK_SLOT_SILENCE;
+		}
+		marker ^= PACK_DOP_TOGGLE;
+
+		/* two DSD bytes per channel and DoP frame */
+		if (width != 4) {
+			src += channels << 1;
+		} else {
+			if (low)
+				src += channels << 2;
+			low = !low;
+		}
+	}
+}
+
+#define MYTEK_PACK_DSD_VARIANT(fmt, width, ch) \
+static void mytek_pack_##fmt##_##ch(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	mytek_pack_dop_frames(p, dest, src, frames, ch, width, false, \
+			mytek_pack_##fmt); \
+}
+
+#define MYTEK_PACK_DSD_VARIANTS(fmt, width) \
+static void mytek_pack_##fmt##_routed(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	mytek_pack_dop_frames(p, dest, src, frames, p->channels, width, \
+			true, mytek_pack_##fmt); \
+} \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 1) \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 2) \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 3) \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 4) \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 5) \
+MYTEK_PACK_DSD_VARIANT(fmt, width, 6) \
+static void (* const mytek_pack_##fmt##_ops[PACK_MAX_SLOTS])( \
+		const struct pcm_packer *p, __le32 *dest, \
+		const u8 *src, unsigned int frames) = { \
+	mytek_pack_##fmt##_1, mytek_pack_##fmt##_2, mytek_pack_##fmt##_3, \
+	mytek_pack_##fmt##_4, mytek_pack_##fmt##_5, mytek_pack_##fmt##_6 \
+};
+
+MYTEK_PACK_DSD_VARIANTS(dsd_u8, 1)
+MYTEK_PACK_DSD_VARIANTS(dsd_u16le, 2)
+MYTEK_PACK_DSD_VARIANTS(dsd_u32le, 4)
+MYTEK_PACK_DSD_VARIANTS(dsd_u32be, 4)
+#endif
+
+#ifdef MYTEK_PACK_SIMD
+static bool mytek_pack_simd_supported(void)
+{
+#ifdef CONFIG_X86
+	return boot_cpu_has(X86_FEATURE_XMM2);
+#elif defined(CONFIG_ARM64)
+	return true;
+#else
+	return cpu_has_neon();
+#endif
+}
+
+/*
+ * Vector kernels exist for layouts that are a plain per slot map
+ * (channels == out_slots) and for stereo in the 6 slot layout.
+ * Everything else stays on the scalar packers.
+ */
+static void mytek_pack_simd_init(struct pcm_packer *p,
+		snd_pcm_format_t format)
+{
+	bool s32 = format == SNDRV_PCM_FORMAT_S32_LE;
+
+	p->pack_simd = NULL;
+	if (!mytek_pack_simd_supported() || (!s32
+			&& format != SNDRV_PCM_FORMAT_S24_LE))
+		return;
+
+	if (p->channels == p->out_slots)
+		p->pack_simd = s32 ? mytek_pack_simd_s32_dense
+				: mytek_pack_simd_s24_dense;
+	else if (p->channels == 2 && p->out_slots == 6)
+		p->pack_simd = s32 ? mytek_pack_simd_s32_2in6
+				: mytek_pack_simd_s24_2in6;
+}
+
+static bool mytek_pack_simd_begin(void)
+{
+	if (!may_use_simd())
+		return false;
+#ifdef CONFIG_X86
+	kernel_fpu_begin();
+#else
+	kernel_neon_begin();
+#endif
+	return true;
+}
+
+static void mytek_pack_simd_end(void)
+{
+#ifdef CONFIG_X86
+	kernel_fpu_end();
+#else
+	kernel_neon_end();
+#endif
+}
+#else
+static inline void mytek_pack_simd_init(struct pcm_packer *p,
+		snd_pcm_format_t format)
+{
+	p->pack_simd = NULL;
+}
+
+static inline bool mytek_pack_simd_begin(void)
+{
+	return false;
+}
+
+static inline void mytek_pack_simd_end(void)
+{
+}
+#endif
+
+/* routed packer for mono, else the one for the channel count */
+#define MYTEK_PACK_SELECT(fmt) \
+	(routed ? mytek_pack_##fmt##_routed : mytek_pack_##fmt##_ops[channels - 1])
+
+/* select the packer for format and channel count, call at hw_params */
+int mytek_pack_init(struct pcm_packer *p, snd_pcm_format_t format,
+		unsigned int channels, unsigned int out_slots)
+{
+	bool routed = channels == 1 && out_slots > 1;
+	unsigned int slot;
+
+	if (channels < 1 || channels > out_slots || out_slots > PACK_MAX_SLOTS)
+		return -EINVAL;
+
+	for (slot = 0; slot < PACK_MAX_SLOTS; slot++)
+		p->route[slot] = slot < channels ? slot : PACK_ROUTE_NONE;
+	/* mono to both dac slots */
+	if (routed)
+		p->route[1] = 0;
+
+	p->frame_bytes = channels << 2;
+	p->src_shift = 0;
+	p->dev_shift = 0;
+	p->dop = false;
+
+	switch (format) {
+	case SNDRV_PCM_FORMAT_S24_LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(s24);
+		break;
+	case SNDRV_PCM_FORMAT_S32_LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(s32);
+		break;
+	case SNDRV_PCM_FORMAT_S16_LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(s16);
+		p->frame_bytes = channels << 1;
+		break;
+	case SNDRV_PCM_FORMAT_S24_3LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(s24_3le);
+		p->frame_bytes = channels * 3;
+		break;
+#ifdef MYTEK_PACK_DSD
+	/* one DoP frame holds two DSD bytes per channel */
+	case SNDRV_PCM_FORMAT_DSD_U8:
+		p->pack_scalar = MYTEK_PACK_SELECT(dsd_u8);
+		p->dop = true;
+		p->frame_bytes = channels << 1;
+		p->src_shift = 1;
+		break;
+	case SNDRV_PCM_FORMAT_DSD_U16_LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(dsd_u16le);
+		p->dop = true;
+		p->frame_bytes = channels << 1;
+		break;
+	case SNDRV_PCM_FORMAT_DSD_U32_LE:
+		p->pack_scalar = MYTEK_PACK_SELECT(dsd_u32le);
+		p->dop = true;
+		p->frame_bytes = channels << 1;
+		p->dev_shift = 1;
+		break;
+	case SNDRV_PCM_FORMAT_DSD_U32_BE:
+		p->pack_scalar = MYTEK_PACK_SELECT(dsd_u32be);
+		p->dop = true;
+		p->frame_bytes = channels << 1;
+		p->dev_shift = 1;
+		break;
+#endif
+	default:
+		return -EINVAL;
+	}
+
+	p->pack = p->pack_scalar;
+	p->dop_marker = PACK_DOP_MARKER;
+	p->phase = false;
+	p->channels = channels;
+	p->out_slots = out_slots;
+	p->simd = false;
+	mytek_pack_simd_init(p, format);
+	return 0;
+}
+
+/* enter a packing section, picks the vector kernel if usable right now */
+void mytek_pack_begin(struct pcm_packer *p)
+{
+	if (p->pack_simd && mytek_pack_simd_begin()) {
+		p->pack = p->pack_simd;
+		p->simd = true;
+	} else
+		p->pack = p->pack_scalar;
+}
+
+void mytek_pack_end(struct pcm_packer *p)
+{
+	if (p->simd) {
+		mytek_pack_simd_end();
+		p->simd = false;
+	}
+	p->pack = p->pack_scalar;
+}
+
+/*
+ * write header and 'frames' frames from ring to dest, returns end of packet.
+ * Ring size and position are in packer frames.
+ */
+u8 *mytek_pack_packet(struct pcm_packer *p, u8 *dest,
+		unsigned int frames, struct pack_ring *ring)
+{
+	__le32 *slot = (__le32 *) dest;
+	unsigned int n;
+
+	*(slot++) = mytek_pack_header(frames);
+	while (frames) {
+		n = min(frames, ring->size - ring->pos);
+		p->phase = p->dev_shift && (ring->pos & 1);
+		p->pack(p, slot, ring->area + ring->pos * p->frame_bytes, n);
+		if (n & 1)
+			p->dop_marker ^= PACK_DOP_TOGGLE;
+		slot += n * p->out_slots;
+		frames -= n;
+		ring->pos += n;
+		if (ring->pos == ring->size)
+			ring->pos = 0;
+	}
+	return (u8 *) slot;
+}
+
+/*
+ * write header and 'frames' frames of DoP silence to dest, returns end of
+ * packet. Continues the marker sequence of p, so a DSD stream stays
+ * locked while paused. Slots without a channel are plain silence.
+ */
+u8 *mytek_pack_dop_silence(struct pcm_packer *p, u8 *dest,
+		unsigned int frames)
+{
+	__le32 *slot = (__le32 *) dest;
+	__le32 idle;
+	unsigned int i;
+
+	*(slot++) = mytek_pack_header(frames);
+	while (frames--) {
+		idle = cpu_to_le32(PACK_SLOT_MARKER | p->dop_marker << 16
+				| PACK_DOP_IDLE);
+		for (i = 0; i < p->out_slots; i++)
+			*(slot++) = p->route[i] == PACK_ROUTE_NONE
+					? PACK_SLOT_SILENCE : idle;
+		p->dop_marker ^= PACK_DOP_TOGGLE;
+	}
+	return (u8 *) slot;
+}
+
+/* fill 'bytes' of dest with silence slots, the template of a silent urb.
+ * Its packets then only need a header, see mytek_pack_silence_header. */
+void mytek_pack_silence_fill(u8 *dest, unsigned int bytes)
+{
+	__le32 *slot = (__le32 *) dest;
+	__le32 *end = slot + (bytes >> 2);
+
+	while (slot != end)
+		*(slot++) = PACK_SLOT_SILENCE;
+}
+
+/* header of a silent packet of 'frames' frames at dest */
+void mytek_pack_silence_header(u8 *dest, unsigned int frames)
+{
+	*((__le32 *) dest) = mytek_pack_header(frames);
+}
+
+/* turn a header written by mytek_pack_silence_header back into silence */
+void mytek_pack_silence_clear(u8 *dest)
+{
+	*((__le32 *) dest) = PACK_SLOT_SILENCE;
+}
@@ -0,0 +1,117 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef MYTEK_PACK_H
+#define MYTEK_PACK_H
+
+#include <sound/pcm.h>
+
+#include "common.h"
+
+enum /* settings for the out urb packer */
+{
+	PACK_HEADER_SIZE = 4, PACK_MAX_SLOTS = 6,
+	PACK_STEREO_SLOTS = 2 /* out endpoint sized for stereo */
+};
+
+/* upper byte of every 32 bit out slot, 0x40 for analog channels */
+#define PACK_SLOT_MARKER	0x40000000
+
+/* pcm_packer.route entry of a silent slot */
+#define PACK_ROUTE_NONE		0xff
+
+/* native DSD formats, sent as DoP. The last of them appeared in 4.1 */
+#ifdef SNDRV_PCM_FORMAT_DSD_U32_BE
+#define MYTEK_PACK_DSD
+#endif
+
+/* alsa ring buffer the packer reads sample data from */
+struct pack_ring {
+	const u8 *area;
+	unsigned int size; /* ring size in packer frames */
+	unsigned int pos; /* current read position in packer frames */
+};
+
+struct pcm_packer {
+	/* packs 'frames' frames from src to dest, src must not wrap.
+	 * points to pack_scalar or, between mytek_pack_begin and
+	 * mytek_pack_end, to pack_simd if the cpu allows it */
+	void (*pack)(const struct pcm_packer *p, __le32 *dest,
+			const u8 *src, unsigned int frames);
+	void (*pack_scalar)(const struct pcm_packer *p, __le32 *dest,
+			const u8 *src, unsigned int frames);
+	void (*pack_simd)(const struct pcm_packer *p, __le32 *dest,
+			const u8 *src, unsigned int frames);
+	bool simd; /* inside a simd section */
+
+	unsigned int frame_bytes; /* bytes per packer frame */
+	unsigned int channels; /* alsa channels */
+	unsigned int out_slots; /* 32 bit slots per frame the device expects */
+	/* alsa channel of each slot. Only used by the routed packers,
+	 * the others map channel n to slot n */
+	u8 route[PACK_MAX_SLOTS];
+
+	/* packer frames are device frames. For DoP an alsa DSD_U8 frame is
+	 * half of one (src_shift 1), a DSD_U32 frame two (dev_shift 1) */
+	unsigned int src_shift;
+	unsigned int dev_shift;
+	bool dop; /* DSD format, sent as DoP */
+	u8 dop_marker; /* DoP marker of the next frame */
+	bool phase; /* DSD_U32: next frame is the low half of an alsa frame */
+};
+
+/* alsa frames (or rate) to device frames (or rate) */
+static inline unsigned int mytek_pack_dev_frames(const struct pcm_packer *p,
+		unsigned int frames)
+{
+	return frames << p->dev_shift >> p->src_shift;
+}
+
+/* device frames to alsa frames */
+static inline unsigned int mytek_pack_alsa_frames(
+		const struct pcm_packer *p, unsigned int frames)
+{
+	return frames << p->src_shift >> p->dev_shift;
+}
+
+/* slots per out frame, fixed by the endpoint size (see mytek_fw_stereo) */
+static inline unsigned int mytek_pack_out_slots(bool stereo)
+{
+	return stereo ? PACK_STEREO_SLOTS : PACK_MAX_SLOTS;
+}
+
+int mytek_pack_init(struct pcm_packer *p, snd_pcm_format_t format,
+		unsigned int channels, unsigned int out_slots);
+void mytek_pack_begin(struct pcm_packer *p);
+void mytek_pack_end(struct pcm_packer *p);
+u8 *mytek_pack_packet(struct pcm_packer *p, u8 *dest,
+		unsigned int frames, struct pack_ring *ring);
+u8 *mytek_pack_dop_silence(struct pcm_packer *p, u8 *dest,
+		unsigned int frames);
+void mytek_pack_silence_fill(u8 *dest, unsigned int bytes);
+void mytek_pack_silence_header(u8 *dest, unsigned int frames);
+void mytek_pack_silence_clear(u8 *dest);
+
+#ifdef MYTEK_PACK_SIMD
+/* vector kernels, see pack_simd.c. Only call between mytek_pack_begin
+ * and mytek_pack_end. */
+void mytek_pack_simd_s24_dense(const struct pcm_packer *p, __le32 *dest,
+		const u8 *src, unsigned int frames);
+void mytek_pack_simd_s32_dense(const struct pcm_packer *p, __le32 *dest,
+		const u8 *src, unsigned int frames);
+void mytek_pack_simd_s24_2in6(const struct pcm_packer *p, __le32 *dest,
+		const u8 *src, unsigned int frames);
+void mytek_pack_simd_s32_2in6(const struct pcm_packer *p, __le32 *dest,
+		const u8 *src, unsigned int frames);
+#endif
+#endif /* MYTEK_PACK_H */
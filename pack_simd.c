@@ -0,0 +1,101 @@
+/*
+ * Linux driver for Mytek Digital Stereo192-DSD DAC USB2
+ *
+ * Vector out urb packing kernels (SSE2, NEON)
+ *
+ * Adapted for Mytek by	: Jurgen Kramer
+ * Last updated		: Oct 17, 2026
+ * Copyright		: (C) Jurgen Kramer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * This file is built with the fpu/vector unit enabled. It must only
+ * contain the kernels themselves, they are called between
+ * mytek_pack_begin and mytek_pack_end (see pack.c). Written with gcc
+ * vector extensions so the same source gives SSE2 on x86 and NEON on
+ * ARM. Little endian hosts only.
+ */
+
+#include <linux/kernel.h>
+#include <linux/string.h>
+
+#include "pack.h"
+
+typedef u32 pack_v4 __attribute__((vector_size(16)));
+
+/* sample conversions, work on scalars and vectors alike */
+#define PACK_S24(x)	(((x) & 0x00ffffff) | PACK_SLOT_MARKER)
+#define PACK_S32(x)	(((x) >> 8) | PACK_SLOT_MARKER)
+
+static inline pack_v4 mytek_pack_simd_load(const u8 *src)
+{
+	pack_v4 v;
+
+	memcpy(&v, src, sizeof(v));
+	return v;
+}
+
+static inline void mytek_pack_simd_store(__le32 *dest, pack_v4 v)
+{
+	memcpy(dest, &v, sizeof(v));
+}
+
+/* channels == out_slots: every alsa sample maps to the next slot */
+#define MYTEK_PACK_SIMD_DENSE(fmt, conv) \
+void mytek_pack_simd_##fmt##_dense(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	unsigned int n = frames * p->out_slots; \
+	const u32 *s; \
+\
+	for (; n >= 8; n -= 8, src += 32, dest += 8) { \
+		mytek_pack_simd_store(dest, \
+				conv(mytek_pack_simd_load(src))); \
+		mytek_pack_simd_store(dest + 4, \
+				conv(mytek_pack_simd_load(src + 16))); \
+	} \
+	for (s = (const u32 *) src; n; n--) \
+		*(dest++) = cpu_to_le32(conv(*(s++))); \
+}
+
+/*
+ * stereo into the 6 slot layout, two frames per step:
+ * in  [l0 r0 l1 r1] -> out [l0 r0 -- --] [-- -- l1 r1] [-- -- -- --]
+ * every converted lane already carries the marker, so blending with
+ * silence is a plain and/or.
+ */
+#define MYTEK_PACK_SIMD_2IN6(fmt, conv) \
+void mytek_pack_simd_##fmt##_2in6(const struct pcm_packer *p, \
+		__le32 *dest, const u8 *src, unsigned int frames) \
+{ \
+	const pack_v4 lo = { ~0u, ~0u, 0, 0 }; \
+	const pack_v4 hi = { 0, 0, ~0u, ~0u }; \
+	const pack_v4 silence = { PACK_SLOT_MARKER, PACK_SLOT_MARKER, \
+			PACK_SLOT_MARKER, PACK_SLOT_MARKER }; \
+	const u32 *s; \
+	pack_v4 v; \
+\
+	for (; frames >= 2; frames -= 2, src += 16, dest += 12) { \
+		v = conv(mytek_pack_simd_load(src)); \
+		mytek_pack_simd_store(dest, (v & lo) | silence); \
+		mytek_pack_simd_store(dest + 4, (v & hi) | silence); \
+		mytek_pack_simd_store(dest + 8, silence); \
+	} \
+	if (frames) { \
+		s = (const u32 *) src; \
+		dest[0] = cpu_to_le32(conv(s[0])); \
+		dest[1] = cpu_to_le32(conv(s[1])); \
+		dest[2] = dest[3] = dest[4] = dest[5] = \
+				cpu_to_le32(PACK_SLOT_MARKER); \
+	} \
+}
+
+MYTEK_PACK_SIMD_DENSE(s24, PACK_S24)
+MYTEK_PACK_SIMD_DENSE(s32, PACK_S32)
+MYTEK_PACK_SIMD_2IN6(s24, PACK_S24)
+MYTEK_PACK_SIMD_2IN6(s32, PACK_S32)
@@ -15,13 +15,17 @@
  * (at your option) any later version.
  */
 
+#include <linux/moduleparam.h>
+#include <sound/pcm_params.h>
+#include <sound/info.h>
+
 #include "pcm.h"
 #include "chip.h"
 #include "comm.h"
 #include "control.h"
 
 enum {
-	OUT_N_CHANNELS = 6, IN_N_CHANNELS = 4
+	IN_N_CHANNELS = 4
 };
 
 /* keep next two synced with
@@ -29,16 +33,41 @@ enum {
  * and CONTROL_RATE_XXX in control.h */
 static const int rates_in_packet_size[] = { 228, 228, 420, 420, 404, 404 };
 static const int rates_out_packet_size[] = { 228, 228, 420, 420, 604, 604 };
+static const int rates_out_packet_size_stereo[] = { 60, 60, 108, 108, 204, 204 };
 static const int rates[] = { 44100, 48000, 88200, 96000, 176400, 192000 };
-static const int rates_alsaid[] = {
-	SNDRV_PCM_RATE_44100, SNDRV_PCM_RATE_48000,
-	SNDRV_PCM_RATE_88200, SNDRV_PCM_RATE_96000,
-	SNDRV_PCM_RATE_176400, SNDRV_PCM_RATE_192000 };
 
 enum { /* settings for pcm */
-	OUT_EP = 6, IN_EP = 2, MAX_BUFSIZE = 128 * 1024
+	OUT_EP = 6, IN_EP = 2, MAX_BUFSIZE = 128 * 1024,
+	/* isochronous packets per second, one per microframe */
+	PACKETS_PER_SEC = 8000,
+	/* smallest period, in packets */
+	MIN_PERIOD_PACKETS = 2
 };
 
+/* upper limits of the urb ring, hw_params picks fewer/smaller urbs
+ * when the client asks for small periods or buffers */
+static unsigned int urbs = 16;
+static unsigned int packets_per_urb = 8;
+/* out urb pool, 0 follows the in urb ring */
+static unsigned int out_urbs;
+
+/* seconds the stream keeps running after the last close */
+static unsigned int linger;
+
+/* pack out urbs from .ack, see mytek_pcm_queue_out */
+static bool lowlatency;
+
+module_param(urbs, uint, 0444);
+MODULE_PARM_DESC(urbs, "Maximum number of in flight urbs per direction (2-32).");
+module_param(packets_per_urb, uint, 0444);
+MODULE_PARM_DESC(packets_per_urb, "Maximum number of isochronous packets per urb (1-16).");
+module_param(out_urbs, uint, 0444);
+MODULE_PARM_DESC(out_urbs, "Number of out urbs (2-32, 0 = same as in urbs).");
+module_param(linger, uint, 0644);
+MODULE_PARM_DESC(linger, "Seconds to keep streaming silence after close (0 = stop at once).");
+module_param(lowlatency, bool, 0644);
+MODULE_PARM_DESC(lowlatency, "Pack out urbs when the application writes instead of at the next in urb.");
+
 enum { /* pcm streaming states */
 	STREAM_DISABLED, /* no pcm streaming */
 	STREAM_STARTING, /* pcm streaming requested, waiting to become ready */
@@ -46,28 +75,76 @@ enum { /* pcm streaming states */
 	STREAM_STOPPING
 };
 
+/* pcm formats, all widened to 24 bit by the packer */
+#define PCM_FMTBIT_PCM	(SNDRV_PCM_FMTBIT_S16_LE | SNDRV_PCM_FMTBIT_S24_LE \
+		| SNDRV_PCM_FMTBIT_S24_3LE | SNDRV_PCM_FMTBIT_S32_LE)
+
+#ifdef MYTEK_PACK_DSD
+#define PCM_FMTBIT_DSD	(SNDRV_PCM_FMTBIT_DSD_U8 | SNDRV_PCM_FMTBIT_DSD_U16_LE \
+		| SNDRV_PCM_FMTBIT_DSD_U32_LE | SNDRV_PCM_FMTBIT_DSD_U32_BE)
+#define PCM_RATE_DSD	SNDRV_PCM_RATE_KNOT /* DSD_U8 at 352.8k, see pcm_dsd */
+#define PCM_RATE_MAX	352800
+#else
+#define PCM_FMTBIT_DSD	0
+#define PCM_RATE_DSD	0
+#define PCM_RATE_MAX	192000
+#endif
+
+/*
+ * the dac plays slots 0 and 1, the other slots go to I2S lines it does
+ * not output. Mono is sent to both slots (see mytek_pack_init).
+ */
+static const struct snd_pcm_chmap_elem pcm_chmaps[] = {
+	{ .channels = 1, .map = { SNDRV_CHMAP_MONO } },
+	{ .channels = 2, .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR } },
+	{ .channels = 3, .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+			SNDRV_CHMAP_UNKNOWN } },
+	{ .channels = 4, .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+			SNDRV_CHMAP_UNKNOWN, SNDRV_CHMAP_UNKNOWN } },
+	{ .channels = 5, .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+			SNDRV_CHMAP_UNKNOWN, SNDRV_CHMAP_UNKNOWN,
+			SNDRV_CHMAP_UNKNOWN } },
+	{ .channels = 6, .map = { SNDRV_CHMAP_FL, SNDRV_CHMAP_FR,
+			SNDRV_CHMAP_UNKNOWN, SNDRV_CHMAP_UNKNOWN,
+			SNDRV_CHMAP_UNKNOWN, SNDRV_CHMAP_UNKNOWN } },
+	{ }
+};
+
+/* out channels of the device, valid before any stream has run */
+int mytek_pcm_out_channels(struct pcm_runtime *rt)
+{
+	return mytek_pack_out_slots(rt->chip->stereo);
+}
+
+static int mytek_pcm_out_packet_size(struct pcm_runtime *rt, int rate)
+{
+	return rt->chip->stereo ? rates_out_packet_size_stereo[rate]
+			: rates_out_packet_size[rate];
+}
+
 static const struct snd_pcm_hardware pcm_hw = {
 	.info = SNDRV_PCM_INFO_MMAP |
 		SNDRV_PCM_INFO_INTERLEAVED |
 		SNDRV_PCM_INFO_BLOCK_TRANSFER |
 		SNDRV_PCM_INFO_MMAP_VALID |
-		SNDRV_PCM_INFO_BATCH,
+		SNDRV_PCM_INFO_NO_PERIOD_WAKEUP,
 
-	.formats = SNDRV_PCM_FMTBIT_S24_LE | SNDRV_PCM_FMTBIT_S32_LE,
+	.formats = PCM_FMTBIT_PCM | PCM_FMTBIT_DSD,
 
 	.rates = SNDRV_PCM_RATE_44100 |
 		SNDRV_PCM_RATE_48000 |
 		SNDRV_PCM_RATE_88200 |
 		SNDRV_PCM_RATE_96000 |
 		SNDRV_PCM_RATE_176400 |
-		SNDRV_PCM_RATE_192000,
+		SNDRV_PCM_RATE_192000 |
+		PCM_RATE_DSD,
 
 	.rate_min = 44100,
-	.rate_max = 192000,
+	.rate_max = PCM_RATE_MAX,
 	.channels_min = 1,
 	.channels_max = 0, /* set in pcm_open, depending on capture/playback */
 	.buffer_bytes_max = MAX_BUFSIZE,
-	.period_bytes_min = PCM_N_PACKETS_PER_URB * (PCM_MAX_PACKET_SIZE - 4),
+	.period_bytes_min = 64, /* see mytek_pcm_rule_period_size */
 	.period_bytes_max = MAX_BUFSIZE,
 	.periods_min = 2,
 	.periods_max = 1024
@@ -95,8 +172,8 @@ static int mytek_pcm_set_rate(struct pcm_runtime *rt)
 		return ret;
 	}
 
-	ret = ctrl_rt->set_channels(ctrl_rt, OUT_N_CHANNELS, IN_N_CHANNELS,
-			false, false);
+	ret = ctrl_rt->set_channels(ctrl_rt, mytek_pcm_out_channels(rt),
+			IN_N_CHANNELS, false, false);
 	if (ret < 0) {
 		dev_err(&rt->chip->dev->dev,
 				"error initializing channels while setting samplerate %d.\n",
@@ -114,12 +191,116 @@ static int mytek_pcm_set_rate(struct pcm_runtime *rt)
 	}
 
 	rt->in_n_analog = IN_N_CHANNELS;
-	rt->out_n_analog = OUT_N_CHANNELS;
+	rt->out_n_analog = mytek_pcm_out_channels(rt);
 	rt->in_packet_size = rates_in_packet_size[rt->rate];
-	rt->out_packet_size = rates_out_packet_size[rt->rate];
+	rt->out_packet_size = mytek_pcm_out_packet_size(rt, rt->rate);
 	return 0;
 }
 
+#ifdef MYTEK_PACK_DSD
+/* keep synced with PCM_FMTBIT_PCM */
+static const snd_pcm_format_t pcm_formats[] = {
+	SNDRV_PCM_FORMAT_S16_LE, SNDRV_PCM_FORMAT_S24_LE,
+	SNDRV_PCM_FORMAT_S24_3LE, SNDRV_PCM_FORMAT_S32_LE
+};
+
+/* DSD is sent as DoP at 176.4k, i.e. DSD64. Alsa rate of each format */
+static const struct {
+	snd_pcm_format_t format;
+	unsigned int rate;
+} pcm_dsd[] = {
+	{ SNDRV_PCM_FORMAT_DSD_U8, 352800 },
+	{ SNDRV_PCM_FORMAT_DSD_U16_LE, 176400 },
+	{ SNDRV_PCM_FORMAT_DSD_U32_LE, 88200 },
+	{ SNDRV_PCM_FORMAT_DSD_U32_BE, 88200 }
+};
+
+static const unsigned int pcm_dsd_rates[] = {
+	44100, 48000, 88200, 96000, 176400, 192000, 352800
+};
+
+static const struct snd_pcm_hw_constraint_list pcm_dsd_rate_list = {
+	.count = ARRAY_SIZE(pcm_dsd_rates),
+	.list = pcm_dsd_rates
+};
+
+/* rates left by the possible formats: pcm rates, DSD rate per format */
+static int mytek_pcm_rule_dsd_rate(struct snd_pcm_hw_params *params,
+		struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *format = hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_FORMAT);
+	struct snd_interval *rate = hw_param_interval(params,
+			SNDRV_PCM_HW_PARAM_RATE);
+	struct snd_interval t;
+	int i;
+
+	snd_interval_any(&t);
+	t.min = UINT_MAX;
+	t.max = 0;
+	for (i = 0; i < ARRAY_SIZE(pcm_formats); i++)
+		if (snd_mask_test(format, pcm_formats[i])) {
+			t.min = rates[0];
+			t.max = rates[ARRAY_SIZE(rates) - 1];
+		}
+	for (i = 0; i < ARRAY_SIZE(pcm_dsd); i++)
+		if (snd_mask_test(format, pcm_dsd[i].format)) {
+			t.min = min(t.min, pcm_dsd[i].rate);
+			t.max = max(t.max, pcm_dsd[i].rate);
+		}
+	return snd_interval_refine(rate, &t);
+}
+
+/* formats left by the possible rates */
+static int mytek_pcm_rule_dsd_format(struct snd_pcm_hw_params *params,
+		struct snd_pcm_hw_rule *rule)
+{
+	struct snd_mask *format = hw_param_mask(params,
+			SNDRV_PCM_HW_PARAM_FORMAT);
+	struct snd_interval *rate = hw_param_interval(params,
+			SNDRV_PCM_HW_PARAM_RATE);
+	struct snd_mask m;
+	int i;
+
+	snd_mask_none(&m);
+	if (rate->min <= rates[ARRAY_SIZE(rates) - 1])
+		for (i = 0; i < ARRAY_SIZE(pcm_formats); i++)
+			snd_mask_set(&m, pcm_formats[i]);
+	for (i = 0; i < ARRAY_SIZE(pcm_dsd); i++)
+		if (snd_interval_test(rate, pcm_dsd[i].rate))
+			snd_mask_set(&m, pcm_dsd[i].format);
+	return snd_mask_refine(format, &m);
+}
+
+static int mytek_pcm_add_dsd_rules(struct snd_pcm_runtime *alsa_rt)
+{
+	int ret;
+
+	ret = snd_pcm_hw_constraint_list(alsa_rt, 0, SNDRV_PCM_HW_PARAM_RATE,
+			&pcm_dsd_rate_list);
+	if (ret < 0)
+		return ret;
+	ret = snd_pcm_hw_rule_add(alsa_rt, 0, SNDRV_PCM_HW_PARAM_RATE,
+			mytek_pcm_rule_dsd_rate, NULL,
+			SNDRV_PCM_HW_PARAM_FORMAT, -1);
+	if (ret < 0)
+		return ret;
+	ret = snd_pcm_hw_rule_add(alsa_rt, 0, SNDRV_PCM_HW_PARAM_FORMAT,
+			mytek_pcm_rule_dsd_format, NULL,
+			SNDRV_PCM_HW_PARAM_RATE, -1);
+	if (ret < 0)
+		return ret;
+	/* a DSD_U8 ring must hold whole DoP frames */
+	return snd_pcm_hw_constraint_step(alsa_rt, 0,
+			SNDRV_PCM_HW_PARAM_BUFFER_SIZE, 2);
+}
+#else
+static inline int mytek_pcm_add_dsd_rules(struct snd_pcm_runtime *alsa_rt)
+{
+	return 0;
+}
+#endif
+
 static struct pcm_substream *mytek_pcm_get_substream(
 		struct snd_pcm_substream *alsa_sub)
 {
@@ -132,6 +313,444 @@ static struct pcm_substream *mytek_pcm_get_substream(
 	return NULL;
 }
 
+/*
+ * The smallest period is MIN_PERIOD_PACKETS packets at the given rate.
+ * Any larger period is allowed: the device is asynchronous and its packet
+ * sizes follow its own clock (implicit feedback), so periods could line
+ * up with urb completions only at the nominal rate anyway.
+ * mytek_pcm_set_urb_geometry sizes the urbs after the chosen period.
+ */
+static int mytek_pcm_rule_period_size(struct snd_pcm_hw_params *params,
+		struct snd_pcm_hw_rule *rule)
+{
+	struct snd_interval *rate = hw_param_interval(params,
+			SNDRV_PCM_HW_PARAM_RATE);
+	struct snd_interval *period = hw_param_interval(params,
+			SNDRV_PCM_HW_PARAM_PERIOD_SIZE);
+	struct snd_interval t;
+
+	snd_interval_any(&t);
+	t.min = DIV_ROUND_UP(rate->min, PACKETS_PER_SEC) * MIN_PERIOD_PACKETS;
+	t.integer = 1;
+	return snd_interval_refine(period, &t);
+}
+
+/* call from the filling context only (see mytek_pcm_queue_out), the
+ * frames are accounted by mytek_pcm_played */
+static void mytek_pcm_playback(struct pcm_substream *sub,
+		struct pcm_urb *urb)
+{
+	int i;
+	int frame_count;
+	struct pcm_runtime *rt = snd_pcm_substream_chip(sub->instance);
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	struct pack_ring ring = {
+		.area = alsa_rt->dma_area,
+		.size = mytek_pack_dev_frames(&sub->packer,
+				alsa_rt->buffer_size),
+		.pos = sub->pack_pos
+	};
+	snd_pcm_uframes_t dma_off = sub->pos.dma_off;
+	snd_pcm_uframes_t new_off;
+	u8 *dest = urb->buffer;
+
+	mytek_pack_begin(&sub->packer);
+	for (i = 0; i < rt->n_packets; i++) {
+		frame_count = mytek_pcm_out_frames(rt, urb->packets[i].length);
+		dest = mytek_pack_packet(&sub->packer, dest, frame_count,
+				&ring);
+	}
+	mytek_pack_end(&sub->packer);
+	sub->pack_pos = ring.pos;
+	new_off = mytek_pack_alsa_frames(&sub->packer, ring.pos);
+	/* alsa frames consumed, an urb never spans the whole buffer */
+	urb->frames = new_off >= dma_off ? new_off - dma_off
+			: new_off + alsa_rt->buffer_size - dma_off;
+}
+
+/* call with substream locked. Account a urb filled by mytek_pcm_playback */
+static void mytek_pcm_played(struct pcm_substream *sub, struct pcm_urb *urb)
+{
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+
+	sub->pack_ptr += urb->frames;
+	if (sub->pack_ptr >= alsa_rt->boundary)
+		sub->pack_ptr -= alsa_rt->boundary;
+
+	write_seqcount_begin(&sub->pos.seq);
+	sub->pos.dma_off = mytek_pack_alsa_frames(&sub->packer, sub->pack_pos);
+	sub->pos.in_flight += urb->frames;
+	sub->pos.last_frames = urb->frames;
+	sub->pos.pack_time = ktime_get();
+	write_seqcount_end(&sub->pos.seq);
+}
+
+static void mytek_pcm_silence(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	int i;
+
+	urb->frames = 0;
+	if (!urb->silent) {
+		mytek_pack_silence_fill(urb->buffer, urb->buffer_size);
+		urb->silent = true;
+		urb->n_headers = 0;
+	}
+
+	/* slots are the same for every rate and channel count, only the
+	 * headers follow the packet sizes */
+	for (i = 0; i < urb->n_headers; i++)
+		mytek_pack_silence_clear(urb->buffer + urb->header_off[i]);
+	for (i = 0; i < rt->n_packets; i++) {
+		urb->header_off[i] = urb->packets[i].offset;
+		mytek_pack_silence_header(urb->buffer + urb->header_off[i],
+				mytek_pcm_out_frames(rt, urb->packets[i].length));
+	}
+	urb->n_headers = rt->n_packets;
+}
+
+/* DoP silence with the marker sequence of p, for a DSD stream that has
+ * nothing to play. Call from the filling context only */
+void mytek_pcm_dop_silence(struct pcm_runtime *rt, struct pcm_packer *p,
+		struct pcm_urb *urb)
+{
+	u8 *dest = urb->buffer;
+	int i;
+
+	urb->frames = 0;
+	urb->silent = false;
+	for (i = 0; i < rt->n_packets; i++)
+		dest = mytek_pack_dop_silence(p, dest,
+				mytek_pcm_out_frames(rt, urb->packets[i].length));
+}
+
+/* call from the filling context only, which owns period_off, and not
+ * under the alsa stream lock. True if the caller has to report a period */
+static bool mytek_pcm_period_done(struct pcm_substream *sub)
+{
+	struct snd_pcm_runtime *alsa_rt;
+
+	if (!smp_load_acquire(&sub->pos.active))
+		return false;
+	alsa_rt = sub->instance->runtime;
+	/* timer scheduled clients poll the pointer instead */
+	if (alsa_rt->no_period_wakeup
+			|| sub->pos.period_off < alsa_rt->period_size)
+		return false;
+	sub->pos.period_off %= alsa_rt->period_size;
+	return true;
+}
+
+/* call from the filling context only, without the substream lock. Out
+ * urb data: playback (if the substream was active when the urb was
+ * taken), source or silence. DoP silence if a DSD format is set up */
+static void mytek_pcm_fill(struct pcm_runtime *rt, struct pcm_urb *urb,
+		bool active, bool dop_idle)
+{
+	bool (*source)(struct pcm_runtime *rt, struct pcm_urb *urb);
+
+	if (active) {
+		urb->silent = false;
+		mytek_pcm_playback(&rt->playback, urb);
+		return;
+	}
+	source = READ_ONCE(rt->source);
+	if (source && source(rt, urb))
+		urb->silent = false;
+	else if (dop_idle)
+		mytek_pcm_dop_silence(rt, &rt->playback.packer, urb);
+	else
+		mytek_pcm_silence(rt, urb);
+}
+
+/* lowlatency: has the application written all frames of urb? */
+static bool mytek_pcm_ready(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	struct pcm_substream *sub = &rt->playback;
+	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
+	snd_pcm_sframes_t queued;
+	unsigned int frames = 0;
+	int i;
+
+	for (i = 0; i < rt->n_packets; i++)
+		frames += mytek_pcm_out_frames(rt, urb->packets[i].length);
+	/* alsa frames, a DSD_U32 frame may be half packed already */
+	frames = mytek_pack_alsa_frames(&sub->packer,
+			frames + sub->packer.dev_shift);
+
+	queued = READ_ONCE(alsa_rt->control->appl_ptr) - sub->pack_ptr;
+	if (queued < 0)
+		queued += alsa_rt->boundary;
+	return queued >= frames;
+}
+
+/* call with substream locked. Packet sizes of an idle out urb */
+static void mytek_pcm_set_packets(struct pcm_runtime *rt, struct pcm_urb *urb,
+		const struct pcm_feedback *fb)
+{
+	int offset = 0;
+	int i;
+
+	for (i = 0; i < rt->n_packets; i++) {
+		urb->packets[i].offset = offset;
+		urb->packets[i].length = fb->length[i];
+		urb->packets[i].status = 0;
+		offset += fb->length[i];
+	}
+}
+
+/*
+ * call with substream locked. Take the next idle out urb with the next
+ * queued feedback, NULL if there is none to send yet. In lowlatency mode
+ * feedback waits until the application has written the frames it asks
+ * for, unless fewer than PCM_LOWLATENCY_URBS out urbs are left on the
+ * bus. Without an active substream out urbs carry the source or silence
+ * at once.
+ */
+static struct pcm_urb *mytek_pcm_next_out(struct pcm_runtime *rt)
+{
+	int min_urbs = min(PCM_LOWLATENCY_URBS, rt->n_out_urbs);
+	struct pcm_urb *urb;
+
+	if (rt->panic || (rt->stream_state != STREAM_STARTING
+			&& rt->stream_state != STREAM_RUNNING)
+			|| !rt->feedback_count || !rt->out_free_count)
+		return NULL;
+
+	urb = rt->out_free[rt->out_free_count - 1];
+	mytek_pcm_set_packets(rt, urb, &rt->feedback[rt->feedback_head]);
+	/* active first: lowlatency is only stable while a substream is */
+	if (READ_ONCE(rt->playback.pos.active) && rt->playback.lowlatency
+			&& rt->out_submitted >= min_urbs
+			&& !mytek_pcm_ready(rt, urb))
+		return NULL;
+	rt->feedback_head = (rt->feedback_head + 1) % PCM_MAX_FEEDBACK;
+	rt->feedback_count--;
+	rt->out_free_count--;
+	return urb;
+}
+
+/* call with substream locked */
+static void mytek_pcm_submit_out(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	if (usb_submit_urb(urb->instance, GFP_ATOMIC) == 0)
+		rt->out_submitted++;
+	else
+		rt->out_free[rt->out_free_count++] = urb;
+}
+
+/*
+ * Send queued feedback in order, each with an idle out urb (see
+ * mytek_pcm_next_out). Takes the substream lock itself: urbs are filled
+ * with it dropped, so the vector packers can run from the completions
+ * (may_use_simd() is false with irqs off). Only one context fills at a
+ * time, which keeps the urbs in feedback order. A caller finding another
+ * one filling leaves the work to it, that one sees the new state before
+ * it stops. The filler reads active once per urb and owns period_off,
+ * neither needs the lock. If elapsed is given, tells if the filler
+ * completed a period; a period completed from .ack is reported by the
+ * next completion.
+ */
+static void mytek_pcm_queue_out(struct pcm_runtime *rt, bool *elapsed)
+{
+	struct pcm_substream *sub = &rt->playback;
+	struct pcm_urb *urb;
+	unsigned long flags;
+	bool active;
+	bool dop_idle;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (!rt->filling) {
+		rt->filling = true;
+		while ((urb = mytek_pcm_next_out(rt))) {
+			active = smp_load_acquire(&sub->pos.active);
+			dop_idle = sub->dop_idle;
+			spin_unlock_irqrestore(&sub->lock, flags);
+			mytek_pcm_fill(rt, urb, active, dop_idle);
+			if (active)
+				sub->pos.period_off += urb->frames;
+			spin_lock_irqsave(&sub->lock, flags);
+			if (active)
+				mytek_pcm_played(sub, urb);
+			mytek_pcm_submit_out(rt, urb);
+		}
+		if (elapsed)
+			*elapsed = mytek_pcm_period_done(sub);
+		rt->filling = false;
+	} else if (elapsed)
+		*elapsed = false;
+	spin_unlock_irqrestore(&sub->lock, flags);
+}
+
+/* process context: lock the substream once no out urb is being filled
+ * with the lock dropped. Before touching what mytek_pcm_fill reads */
+static void mytek_pcm_lock_filled(struct pcm_runtime *rt)
+{
+	spin_lock_irq(&rt->playback.lock);
+	while (rt->filling) {
+		spin_unlock_irq(&rt->playback.lock);
+		cpu_relax();
+		spin_lock_irq(&rt->playback.lock);
+	}
+}
+
+/*
+ * call with substream locked, at stream start. Queue feedback with the
+ * nominal packet sizes of the rate, so out urbs go out before the first
+ * in urb returns. Each in urb then sends one out urb, out keeps running
+ * PCM_LOWLATENCY_URBS ahead; the rest of the n_out_urbs pool takes up
+ * completion jitter.
+ */
+static void mytek_pcm_prime_out(struct pcm_runtime *rt)
+{
+	struct pcm_feedback *fb;
+	unsigned int phase = 0;
+	int n = min(rt->n_out_urbs, (int) PCM_LOWLATENCY_URBS);
+	int i;
+
+	while (n-- && rt->feedback_count < PCM_MAX_FEEDBACK) {
+		fb = &rt->feedback[rt->feedback_count++];
+		for (i = 0; i < rt->n_packets; i++) {
+			phase += rates[rt->rate];
+			fb->length[i] = phase / PACKETS_PER_SEC
+					* (rt->out_n_analog << 2) + 4;
+			phase %= PACKETS_PER_SEC;
+		}
+	}
+}
+
+/* call with substream locked. Start the average of mytek_pcm_in_frames
+ * at the nominal frames per packet of the rate */
+static void mytek_pcm_seed_in_frames(struct pcm_runtime *rt)
+{
+	rt->fb_estimate = div_u64((u64) rates[rt->rate] << PCM_FB_FRACT,
+			PACKETS_PER_SEC);
+	rt->fb_phase = 0;
+}
+
+/*
+ * call with substream locked. Frames in a received in packet. Since
+ * kernel 3.12 some hosts report in packets as empty (see ISSUES), these
+ * get the running average of the frames per packet instead, carrying the
+ * fraction so the average rate stays right.
+ */
+static unsigned int mytek_pcm_in_frames(struct pcm_runtime *rt,
+		const struct usb_iso_packet_descriptor *packet)
+{
+	int frames;
+
+	rt->fb_packets++;
+	if (packet->actual_length < 4) {
+		rt->fb_synthesized++;
+		rt->fb_phase += rt->fb_estimate;
+		frames = rt->fb_phase >> PCM_FB_FRACT;
+		rt->fb_phase &= (1 << PCM_FB_FRACT) - 1;
+		return frames;
+	}
+
+	frames = (packet->actual_length - 4) / (rt->in_n_analog << 2);
+	rt->fb_estimate += ((frames << PCM_FB_FRACT) - rt->fb_estimate)
+			>> PCM_FB_SHIFT;
+	return frames;
+}
+
+static void mytek_pcm_in_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *in_urb = usb_urb->context;
+	struct pcm_runtime *rt = in_urb->chip->pcm;
+	struct pcm_substream *sub;
+	struct pcm_feedback *fb = NULL;
+	unsigned long flags;
+	unsigned int frames;
+	bool elapsed;
+	int i;
+
+	if (usb_urb->status || rt->panic || rt->stream_state == STREAM_STOPPING)
+		return;
+	for (i = 0; i < rt->n_packets; i++)
+		if (in_urb->packets[i].status) {
+			rt->panic = true;
+			return;
+		}
+
+	if (rt->stream_state == STREAM_DISABLED) {
+		dev_err(&rt->chip->dev->dev,
+			"internal error: stream disabled in in-urb handler.\n");
+		return;
+	}
+
+	sub = &rt->playback;
+	spin_lock_irqsave(&sub->lock, flags);
+	/* out lags by more than the whole queue: drop this feedback, the
+	 * device gets one urb less of data */
+	if (rt->feedback_count < PCM_MAX_FEEDBACK) {
+		fb = &rt->feedback[(rt->feedback_head + rt->feedback_count)
+				% PCM_MAX_FEEDBACK];
+		rt->feedback_count++;
+	} else
+		rt->fb_dropped++;
+
+	/* out packet sizes from the frames the device sent */
+	for (i = 0; i < rt->n_packets; i++) {
+		frames = mytek_pcm_in_frames(rt, &in_urb->packets[i]);
+		if (fb)
+			fb->length[i] = min(frames * (rt->out_n_analog << 2)
+					+ 4, (unsigned int) rt->out_packet_size);
+	}
+
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	/* now pack our playback data or silence into idle out urbs, header,
+	 * samples and 0x40 slot markers are written in a single pass */
+	mytek_pcm_queue_out(rt, &elapsed);
+	if (elapsed)
+		snd_pcm_period_elapsed(sub->instance);
+
+	usb_submit_urb(in_urb->instance, GFP_ATOMIC);
+
+	if (rt->stream_state == STREAM_STARTING) {
+		rt->stream_wait_cond = true;
+		wake_up(&rt->stream_wait_queue);
+	}
+}
+
+static void mytek_pcm_out_urb_handler(struct urb *usb_urb)
+{
+	struct pcm_urb *urb = usb_urb->context;
+	struct pcm_runtime *rt = urb->chip->pcm;
+	struct pcm_substream *sub = &rt->playback;
+	unsigned long flags;
+	bool elapsed;
+	bool killed;
+	int i;
+
+	/* unlinked at stream stop or gone with the device */
+	killed = usb_urb->status == -ENOENT || usb_urb->status == -ECONNRESET
+			|| usb_urb->status == -ESHUTDOWN;
+
+	spin_lock_irqsave(&sub->lock, flags);
+	if (usb_urb->status && !killed)
+		rt->out_errors++;
+	else
+		for (i = 0; i < rt->n_packets; i++)
+			if (urb->packets[i].status) {
+				rt->out_errors++;
+				break;
+			}
+	write_seqcount_begin(&sub->pos.seq);
+	sub->pos.in_flight -= min_t(snd_pcm_uframes_t, sub->pos.in_flight,
+			urb->frames);
+	write_seqcount_end(&sub->pos.seq);
+	rt->out_submitted--;
+	rt->out_free[rt->out_free_count++] = urb;
+	spin_unlock_irqrestore(&sub->lock, flags);
+
+	if (killed || rt->stream_state == STREAM_STOPPING)
+		return;
+	mytek_pcm_queue_out(rt, &elapsed);
+	if (elapsed)
+		snd_pcm_period_elapsed(sub->instance);
+}
+
 /* call with stream_mutex locked */
 static void mytek_pcm_stream_stop(struct pcm_runtime *rt)
 {
@@ -142,10 +761,10 @@ static void mytek_pcm_stream_stop(struct pcm_runtime *rt)
 
 		rt->stream_state = STREAM_STOPPING;
 
-		for (i = 0; i < PCM_N_URBS; i++) {
-			usb_kill_urb(&rt->in_urbs[i].instance);
-			usb_kill_urb(&rt->out_urbs[i].instance);
-		}
+		for (i = 0; i < rt->max_urbs; i++)
+			usb_kill_urb(rt->in_urbs[i].instance);
+		for (i = 0; i < rt->max_out_urbs; i++)
+			usb_kill_urb(rt->out_urbs[i].instance);
 
 		ctrl_rt->usb_streaming = false;
 		ctrl_rt->update_streaming(ctrl_rt);
@@ -153,27 +772,118 @@ static void mytek_pcm_stream_stop(struct pcm_runtime *rt)
 	}
 }
 
+static void mytek_pcm_urb_buffer_free(struct pcm_runtime *rt,
+		struct pcm_urb *urb)
+{
+	if (urb->buffer)
+		usb_free_coherent(rt->chip->dev, urb->buffer_size,
+				urb->buffer, urb->dma);
+	urb->buffer = NULL;
+	urb->buffer_size = 0;
+}
+
+/* call with stream_mutex locked, stream disabled. Keeps a buffer that is
+ * already large enough, so going back to a lower rate allocates nothing */
+static int mytek_pcm_urb_buffer_alloc(struct pcm_runtime *rt,
+		struct pcm_urb *urb, int size)
+{
+	if (urb->buffer_size >= size)
+		return 0;
+
+	mytek_pcm_urb_buffer_free(rt, urb);
+	urb->buffer = usb_alloc_coherent(rt->chip->dev, size, GFP_KERNEL,
+			&urb->dma);
+	if (!urb->buffer)
+		return -ENOMEM;
+	urb->buffer_size = size;
+	urb->silent = false;
+	urb->instance->transfer_buffer = urb->buffer;
+	urb->instance->transfer_dma = urb->dma;
+	urb->instance->transfer_buffer_length = size;
+	return 0;
+}
+
+/* call with stream_mutex locked, stream disabled */
+static void mytek_pcm_urb_buffers_free(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < rt->max_out_urbs; i++)
+		mytek_pcm_urb_buffer_free(rt, &rt->out_urbs[i]);
+	for (i = 0; i < rt->max_urbs; i++)
+		mytek_pcm_urb_buffer_free(rt, &rt->in_urbs[i]);
+}
+
+/* call with stream_mutex locked, stream disabled. Size the buffers for
+ * the urb ring at the current rate */
+static int mytek_pcm_urb_buffers_alloc(struct pcm_runtime *rt)
+{
+	int i;
+
+	for (i = 0; i < rt->n_out_urbs; i++)
+		if (mytek_pcm_urb_buffer_alloc(rt, &rt->out_urbs[i],
+				rt->n_packets * rt->out_packet_size))
+			return -ENOMEM;
+	for (i = 0; i < rt->n_urbs; i++)
+		if (mytek_pcm_urb_buffer_alloc(rt, &rt->in_urbs[i],
+				rt->n_packets * rt->in_packet_size))
+			return -ENOMEM;
+	return 0;
+}
+
 /* call with stream_mutex locked */
-static int mytek_pcm_stream_start(struct pcm_runtime *rt)
+static int mytek_pcm_stream_start(struct pcm_runtime *rt, int n_urbs,
+		int n_packets)
 {
 	int ret;
 	int i;
 	int k;
 	struct usb_iso_packet_descriptor *packet;
+	unsigned long flags;
 
 	if (rt->stream_state == STREAM_DISABLED) {
-		/* submit our in urbs */
 		rt->stream_wait_cond = false;
 		rt->stream_state = STREAM_STARTING;
-		for (i = 0; i < PCM_N_URBS; i++) {
-			for (k = 0; k < PCM_N_PACKETS_PER_URB; k++) {
+		rt->n_urbs = n_urbs;
+		rt->n_out_urbs = out_urbs ? rt->max_out_urbs
+				: min(n_urbs, rt->max_out_urbs);
+		rt->n_packets = n_packets;
+
+		ret = mytek_pcm_urb_buffers_alloc(rt);
+		if (ret) {
+			rt->stream_state = STREAM_DISABLED;
+			return ret;
+		}
+
+		/* prime the out side with nominal packet sizes */
+		spin_lock_irqsave(&rt->playback.lock, flags);
+		mytek_pcm_seed_in_frames(rt);
+		rt->feedback_head = 0;
+		rt->feedback_count = 0;
+		rt->out_submitted = 0;
+		rt->out_free_count = rt->n_out_urbs;
+		for (i = 0; i < rt->n_out_urbs; i++) {
+			rt->out_urbs[i].instance->number_of_packets =
+					rt->n_packets;
+			rt->out_urbs[i].frames = 0;
+			rt->out_free[i] = &rt->out_urbs[i];
+		}
+		mytek_pcm_prime_out(rt);
+		spin_unlock_irqrestore(&rt->playback.lock, flags);
+		mytek_pcm_queue_out(rt, NULL);
+
+		/* submit our in urbs */
+		for (i = 0; i < rt->n_urbs; i++) {
+			rt->in_urbs[i].instance->number_of_packets =
+					rt->n_packets;
+			for (k = 0; k < rt->n_packets; k++) {
 				packet = &rt->in_urbs[i].packets[k];
 				packet->offset = k * rt->in_packet_size;
 				packet->length = rt->in_packet_size;
 				packet->actual_length = 0;
 				packet->status = 0;
 			}
-			ret = usb_submit_urb(&rt->in_urbs[i].instance,
+			ret = usb_submit_urb(rt->in_urbs[i].instance,
 					GFP_ATOMIC);
 			if (ret) {
 				mytek_pcm_stream_stop(rt);
@@ -181,7 +891,7 @@ static int mytek_pcm_stream_start(struct pcm_runtime *rt)
 			}
 		}
 
-		/* wait for first out urb to return (sent in in urb handler) */
+		/* wait for the first feedback from the device */
 		wait_event_timeout(rt->stream_wait_queue, rt->stream_wait_cond,
 				HZ);
 		if (rt->stream_wait_cond)
@@ -194,157 +904,25 @@ static int mytek_pcm_stream_start(struct pcm_runtime *rt)
 	return 0;
 }
 
-/* call with substream locked */
-static void mytek_pcm_playback(struct pcm_substream *sub,
-		struct pcm_urb *urb)
+/* call with stream_mutex locked, nobody uses the stream anymore */
+static void mytek_pcm_idle(struct pcm_runtime *rt)
 {
-	int i;
-	int frame;
-	int frame_count;
-	struct pcm_runtime *rt = snd_pcm_substream_chip(sub->instance);
-	struct snd_pcm_runtime *alsa_rt = sub->instance->runtime;
-	u32 *src = (u32 *) (alsa_rt->dma_area + sub->dma_off
-			* (alsa_rt->frame_bits >> 3));
-	u32 *src_end = (u32 *) (alsa_rt->dma_area + alsa_rt->buffer_size
-			* (alsa_rt->frame_bits >> 3));
-	u32 *dest;
-	int bytes_per_frame = alsa_rt->channels << 2;
-
-	if (alsa_rt->format == SNDRV_PCM_FORMAT_S32_LE)
-		dest = (u32 *) (urb->buffer - 1);
-	else if (alsa_rt->format == SNDRV_PCM_FORMAT_S24_LE)
-		dest = (u32 *) (urb->buffer);
-	else {
-		dev_err(&rt->chip->dev->dev, "Unknown sample format.");
-		return;
-	}
-
-	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
-		/* at least 4 header bytes for valid packet.
-		 * after that: 32 bits per sample for analog channels */
-		if (urb->packets[i].length > 4)
-			frame_count = (urb->packets[i].length - 4)
-					/ (rt->out_n_analog << 2);
-		else
-			frame_count = 0;
-		dest++; /* skip leading 4 bytes of every frame */
-		for (frame = 0; frame < frame_count; frame++) {
-			memcpy(dest, src, bytes_per_frame);
-			src += alsa_rt->channels;
-			dest += rt->out_n_analog;
-			sub->dma_off++;
-			sub->period_off++;
-			if (src == src_end) {
-				src = (u32 *) alsa_rt->dma_area;
-				sub->dma_off = 0;
-			}
-		}
+	if (linger && rt->stream_state == STREAM_RUNNING) {
+		rt->lingering = true;
+		schedule_delayed_work(&rt->linger_work, linger * HZ);
+	} else {
+		mytek_pcm_stream_stop(rt);
+		mytek_pcm_urb_buffers_free(rt);
+		rt->rate = ARRAY_SIZE(rates);
 	}
 }
 
-static void mytek_pcm_in_urb_handler(struct urb *usb_urb)
+/* call with stream_mutex locked, the stream gets a new user */
+static void mytek_pcm_unlinger(struct pcm_runtime *rt)
 {
-	struct pcm_urb *in_urb = usb_urb->context;
-	struct pcm_urb *out_urb = in_urb->peer;
-	struct pcm_runtime *rt = in_urb->chip->pcm;
-	struct pcm_substream *sub;
-	unsigned long flags;
-	int total_length = 0;
-	int frame_count;
-	int frame;
-	int channel;
-	int i;
-	u8 *dest;
-
-	if (usb_urb->status || rt->panic || rt->stream_state == STREAM_STOPPING)
-		return;
-	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++)
-		if (in_urb->packets[i].status) {
-			rt->panic = true;
-			return;
-		}
-
-	if (rt->stream_state == STREAM_DISABLED) {
-		dev_err(&rt->chip->dev->dev,
-			"internal error: stream disabled in in-urb handler.\n");
-		return;
-	}
-
-	/* setup out urb structure */
-	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++) {
-
-		// FIXME WORKAROUND for USB issues with kernel 3.12.x and later
-		if (rt->chip->usbworkaround) {
-			if (in_urb->packets[i].actual_length == 0) {
-				in_urb->packets[i].actual_length = 84;
-				} else {
-					dev_info(&rt->chip->dev->dev,
-					"'usbworkaround' no longer needed. Set to disabled.\n");
-					rt->chip->usbworkaround = false;
-				}
-		} else {
-			// usbworkaround is disabled
-			if (in_urb->packets[i].actual_length == 0) {
-				in_urb->packets[i].actual_length = 84;
-				dev_info(&rt->chip->dev->dev,
-				"'usbworkaround' is disabled but needed. Set to enabled.\n");
-				rt->chip->usbworkaround = true;
-			}
-		}
-
-		out_urb->packets[i].offset = total_length;
-		out_urb->packets[i].length = (in_urb->packets[i].actual_length
-				- 4) / (rt->in_n_analog << 2)
-				* (rt->out_n_analog << 2) + 4;
-		out_urb->packets[i].status = 0;
-		total_length += out_urb->packets[i].length;
-	}
-	memset(out_urb->buffer, 0, total_length);
-
-	/* now send our playback data (if a free out urb was found) */
-	sub = &rt->playback;
-	spin_lock_irqsave(&sub->lock, flags);
-	if (sub->active) {
-		mytek_pcm_playback(sub, out_urb);
-		if (sub->period_off >= sub->instance->runtime->period_size) {
-			sub->period_off %= sub->instance->runtime->period_size;
-			spin_unlock_irqrestore(&sub->lock, flags);
-			snd_pcm_period_elapsed(sub->instance);
-		} else
-			spin_unlock_irqrestore(&sub->lock, flags);
-	} else
-		spin_unlock_irqrestore(&sub->lock, flags);
-
-	/* setup the 4th byte of each sample (0x40 for analog channels) */
-	dest = out_urb->buffer;
-	for (i = 0; i < PCM_N_PACKETS_PER_URB; i++)
-		if (out_urb->packets[i].length >= 4) {
-			frame_count = (out_urb->packets[i].length - 4)
-					/ (rt->out_n_analog << 2);
-			*(dest++) = 0xaa;
-			*(dest++) = 0xaa;
-			*(dest++) = frame_count;
-			*(dest++) = 0x00;
-			for (frame = 0; frame < frame_count; frame++)
-				for (channel = 0;
-						channel < rt->out_n_analog;
-						channel++) {
-					dest += 3; /* skip sample data */
-					*(dest++) = 0x40;
-				}
-		}
-	usb_submit_urb(&out_urb->instance, GFP_ATOMIC);
-	usb_submit_urb(&in_urb->instance, GFP_ATOMIC);
-}
-
-static void mytek_pcm_out_urb_handler(struct urb *usb_urb)
-{
-	struct pcm_urb *urb = usb_urb->context;
-	struct pcm_runtime *rt = urb->chip->pcm;
-
-	if (rt->stream_state == STREAM_STARTING) {
-		rt->stream_wait_cond = true;
-		wake_up(&rt->stream_wait_queue);
+	if (rt->lingering) {
+		rt->lingering = false;
+		cancel_delayed_work(&rt->linger_work);
 	}
 }
 
@@ -353,6 +931,7 @@ static int mytek_pcm_open(struct snd_pcm_substream *alsa_sub)
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
 	struct pcm_substream *sub = NULL;
 	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	int ret;
 
 	if (rt->panic)
 		return -EPIPE;
@@ -360,12 +939,27 @@ static int mytek_pcm_open(struct snd_pcm_substream *alsa_sub)
 	mutex_lock(&rt->stream_mutex);
 	alsa_rt->hw = pcm_hw;
 
+	/* the compress device has the stream */
+	if (rt->source) {
+		mutex_unlock(&rt->stream_mutex);
+		return -EBUSY;
+	}
+
+	/* a lingering stream is ours, prepare switches its rate if needed */
+	mytek_pcm_unlinger(rt);
+
 	if (alsa_sub->stream == SNDRV_PCM_STREAM_PLAYBACK) {
 
-		if (rt->rate < ARRAY_SIZE(rates))
-			alsa_rt->hw.rates = rates_alsaid[rt->rate];
-		alsa_rt->hw.channels_max = OUT_N_CHANNELS;
+		alsa_rt->hw.channels_max = mytek_pcm_out_channels(rt);
 		sub = &rt->playback;
+		/* the parameter can change any time, the substream keeps
+		 * the mode it was opened with */
+		sub->lowlatency = READ_ONCE(lowlatency);
+#ifdef SNDRV_PCM_INFO_SYNC_APPLPTR
+		/* mmap clients report their writes, see mytek_pcm_ack */
+		if (sub->lowlatency)
+			alsa_rt->hw.info |= SNDRV_PCM_INFO_SYNC_APPLPTR;
+#endif
 	}
 
 	if (!sub) {
@@ -374,18 +968,43 @@ static int mytek_pcm_open(struct snd_pcm_substream *alsa_sub)
 		return -EINVAL;
 	}
 
+	ret = snd_pcm_hw_rule_add(alsa_rt, 0, SNDRV_PCM_HW_PARAM_PERIOD_SIZE,
+			mytek_pcm_rule_period_size, rt,
+			SNDRV_PCM_HW_PARAM_RATE, -1);
+	if (ret >= 0)
+		ret = mytek_pcm_add_dsd_rules(alsa_rt);
+	if (ret < 0) {
+		mutex_unlock(&rt->stream_mutex);
+		return ret;
+	}
+
 	sub->instance = alsa_sub;
-	sub->active = false;
+	WRITE_ONCE(sub->pos.active, false);
 	mutex_unlock(&rt->stream_mutex);
 
 	return 0;
 }
 
+static void mytek_pcm_linger_work(struct work_struct *work)
+{
+	struct pcm_runtime *rt = container_of(to_delayed_work(work),
+			struct pcm_runtime, linger_work);
+
+	mutex_lock(&rt->stream_mutex);
+	/* reopened meanwhile? then the stream is in use again */
+	if (rt->lingering && !rt->panic) {
+		rt->lingering = false;
+		mytek_pcm_stream_stop(rt);
+		mytek_pcm_urb_buffers_free(rt);
+		rt->rate = ARRAY_SIZE(rates);
+	}
+	mutex_unlock(&rt->stream_mutex);
+}
+
 static int mytek_pcm_close(struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
 	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
-	unsigned long flags;
 
 	if (rt->panic)
 		return 0;
@@ -393,104 +1012,235 @@ static int mytek_pcm_close(struct snd_pcm_substream *alsa_sub)
 	mutex_lock(&rt->stream_mutex);
 	if (sub) {
 		/* deactivate substream */
-		spin_lock_irqsave(&sub->lock, flags);
+		mytek_pcm_lock_filled(rt);
 		sub->instance = NULL;
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
-
-		/* all substreams closed? if so, stop streaming */
-		if (!rt->playback.instance) {
-			mytek_pcm_stream_stop(rt);
-			rt->rate = ARRAY_SIZE(rates);
-		}
+		WRITE_ONCE(sub->pos.active, false);
+		sub->dop_idle = false;
+		spin_unlock_irq(&sub->lock);
+
+		/* all substreams closed? if so, stop streaming, possibly
+		 * after lingering for a while */
+		if (!rt->playback.instance)
+			mytek_pcm_idle(rt);
 	}
 	mutex_unlock(&rt->stream_mutex);
 
 	return 0;
 }
 
+/*
+ * Size the urb ring after the client's request: one urb should not span
+ * more than a period and all urbs in flight should not hold more than
+ * half the buffer. Deep buffers get the full ring of the module
+ * parameters, low latency clients a few small urbs.
+ */
+static void mytek_pcm_set_urb_geometry(struct pcm_runtime *rt,
+		struct pcm_substream *sub, struct snd_pcm_hw_params *hw_params)
+{
+	unsigned int rate = params_rate(hw_params);
+	/* frames per isochronous packet */
+	int fpp = DIV_ROUND_UP(rate, PACKETS_PER_SEC);
+	int period_packets = params_period_size(hw_params) / fpp;
+	int packets;
+
+	packets = clamp_t(int, period_packets, 1, rt->max_packets);
+	/* period of whole nominal packets (48k family only): use urbs that
+	 * divide it, periods then end on urb completions at the nominal
+	 * rate */
+	if (!(rate % PACKETS_PER_SEC)
+			&& !(params_period_size(hw_params) % fpp))
+		while (period_packets % packets)
+			packets--;
+
+	mutex_lock(&rt->stream_mutex);
+	sub->n_packets = packets;
+	sub->n_urbs = clamp_t(int, params_buffer_size(hw_params) / 2
+			/ (packets * fpp), 2, rt->max_urbs);
+	mutex_unlock(&rt->stream_mutex);
+}
+
 static int mytek_pcm_hw_params(struct snd_pcm_substream *alsa_sub,
 		struct snd_pcm_hw_params *hw_params)
 {
-	return snd_pcm_lib_alloc_vmalloc_buffer(alsa_sub,
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
+	int ret;
+
+	if (!sub)
+		return -ENODEV;
+
+	/* a completion may still be packing from before the last stop */
+	mytek_pcm_lock_filled(rt);
+	ret = mytek_pack_init(&sub->packer, params_format(hw_params),
+			params_channels(hw_params), mytek_pcm_out_channels(rt));
+	/* keep a DSD stream in DSD mode while it has nothing to play */
+	sub->dop_idle = !ret && sub->packer.dop;
+	spin_unlock_irq(&sub->lock);
+	if (ret < 0) {
+		dev_err(&rt->chip->dev->dev, "Unknown sample format.");
+		return ret;
+	}
+	mytek_pcm_set_urb_geometry(rt, sub, hw_params);
+
+	/* the buffer is preallocated in mytek_pcm_init */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	return snd_pcm_lib_malloc_pages(alsa_sub,
 			params_buffer_bytes(hw_params));
+#else
+	return 0;
+#endif
 }
 
 static int mytek_pcm_hw_free(struct snd_pcm_substream *alsa_sub)
 {
-	return snd_pcm_lib_free_vmalloc_buffer(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	/* nothing may still read the dma area when it goes */
+	mytek_pcm_lock_filled(rt);
+	rt->playback.dop_idle = false;
+	spin_unlock_irq(&rt->playback.lock);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	return snd_pcm_lib_free_pages(alsa_sub);
+#else
+	return 0;
+#endif
 }
 
-static int mytek_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+/* call with stream_mutex locked, stream running */
+static int mytek_pcm_switch_clock(struct pcm_runtime *rt, unsigned int rate)
 {
-	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
-	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	struct control_runtime *ctrl_rt = rt->chip->control;
+	ktime_t start = ktime_get();
 	int ret;
+	int i;
 
-	if (rt->panic)
-		return -EPIPE;
-	if (!sub)
-		return -ENODEV;
+	for (i = 0; i < ARRAY_SIZE(rates); i++)
+		if (rates[i] == rate)
+			break;
+	if (i == ARRAY_SIZE(rates)
+			|| rates_in_packet_size[i] != rt->in_packet_size
+			|| mytek_pcm_out_packet_size(rt, i) != rt->out_packet_size)
+		return -EINVAL;
 
-	mutex_lock(&rt->stream_mutex);
-	sub->dma_off = 0;
-	sub->period_off = 0;
+	ret = ctrl_rt->set_clock(ctrl_rt, i);
+	if (ret < 0)
+		return ret;
+
+	dev_dbg(&rt->chip->dev->dev, "rate %d -> %d in %lld us\n",
+			rates[rt->rate], rates[i],
+			ktime_us_delta(ktime_get(), start));
+	/* empty in packets get the new rate at once */
+	spin_lock_irq(&rt->playback.lock);
+	rt->rate = i;
+	mytek_pcm_seed_in_frames(rt);
+	spin_unlock_irq(&rt->playback.lock);
+	return 0;
+}
+
+/*
+ * call with stream_mutex locked. Get the stream running at 'rate' (device
+ * rate) with the given urb ring, keeping a running stream if it can be.
+ */
+static int mytek_pcm_stream_setup(struct pcm_runtime *rt, unsigned int rate,
+		int n_urbs, int n_packets)
+{
+	ktime_t start = ktime_get();
+	int ret;
+
+	/* restart streaming if another urb ring is asked for */
+	if (rt->stream_state != STREAM_DISABLED
+			&& (rt->n_urbs != n_urbs || rt->n_packets != n_packets))
+		mytek_pcm_stream_stop(rt);
+
+	/* stream running at another rate (lingering or new hw_params):
+	 * switch the clock if the altsetting stays, restart otherwise */
+	if (rt->stream_state != STREAM_DISABLED
+			&& rates[rt->rate] != rate
+			&& mytek_pcm_switch_clock(rt, rate) < 0)
+		mytek_pcm_stream_stop(rt);
 
 	if (rt->stream_state == STREAM_DISABLED) {
 		for (rt->rate = 0; rt->rate < ARRAY_SIZE(rates); rt->rate++)
-			if (alsa_rt->rate == rates[rt->rate])
+			if (rate == rates[rt->rate])
 				break;
 		if (rt->rate == ARRAY_SIZE(rates)) {
-			mutex_unlock(&rt->stream_mutex);
 			dev_err(&rt->chip->dev->dev,
-				"invalid rate %d in prepare.\n",
-				alsa_rt->rate);
+				"invalid rate %d.\n", rate);
 			return -EINVAL;
 		}
 
 		ret = mytek_pcm_set_rate(rt);
-		if (ret) {
-			mutex_unlock(&rt->stream_mutex);
+		if (ret)
 			return ret;
-		}
-		ret = mytek_pcm_stream_start(rt);
+		ret = mytek_pcm_stream_start(rt, n_urbs, n_packets);
 		if (ret) {
-			mutex_unlock(&rt->stream_mutex);
 			dev_err(&rt->chip->dev->dev,
 				"could not start pcm stream.\n");
 			return ret;
 		}
+		dev_dbg(&rt->chip->dev->dev,
+			"rate %d set and stream started in %lld us\n",
+			rates[rt->rate], ktime_us_delta(ktime_get(), start));
 	}
-	mutex_unlock(&rt->stream_mutex);
-	
 	return 0;
 }
 
+static int mytek_pcm_prepare(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	int ret;
+
+	if (rt->panic)
+		return -EPIPE;
+	if (!sub)
+		return -ENODEV;
+
+	mutex_lock(&rt->stream_mutex);
+	mytek_pcm_lock_filled(rt);
+	sub->pack_pos = 0;
+	sub->pos.period_off = 0;
+	sub->pack_ptr = 0;
+	write_seqcount_begin(&sub->pos.seq);
+	sub->pos.dma_off = 0;
+	sub->pos.in_flight = 0;
+	sub->pos.last_frames = 0;
+	write_seqcount_end(&sub->pos.seq);
+	spin_unlock_irq(&sub->lock);
+
+	/* device rate, DoP runs at another rate than alsa counts DSD in */
+	ret = mytek_pcm_stream_setup(rt,
+			mytek_pack_dev_frames(&sub->packer, alsa_rt->rate),
+			sub->n_urbs, sub->n_packets);
+	mutex_unlock(&rt->stream_mutex);
+
+	return ret;
+}
+
 static int mytek_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
 {
 	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
 
 	if (rt->panic)
 		return -EPIPE;
 	if (!sub)
 		return -ENODEV;
 
+	/* no lock: the filler reads active once per urb, a urb it took
+	 * before the change goes out with the old state. Release pairs
+	 * with its acquire, so a start sees what prepare set up */
 	switch (cmd) {
 	case SNDRV_PCM_TRIGGER_START:
 	case SNDRV_PCM_TRIGGER_PAUSE_RELEASE:
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->active = true;
-		spin_unlock_irqrestore(&sub->lock, flags);
+		smp_store_release(&sub->pos.active, true);
 		return 0;
 
 	case SNDRV_PCM_TRIGGER_STOP:
 	case SNDRV_PCM_TRIGGER_PAUSE_PUSH:
-		spin_lock_irqsave(&sub->lock, flags);
-		sub->active = false;
-		spin_unlock_irqrestore(&sub->lock, flags);
+		smp_store_release(&sub->pos.active, false);
 		return 0;
 
 	default:
@@ -498,24 +1248,117 @@ static int mytek_pcm_trigger(struct snd_pcm_substream *alsa_sub, int cmd)
 	}
 }
 
+/* lowlatency: the application wrote, pack what waits for it */
+static int mytek_pcm_ack(struct snd_pcm_substream *alsa_sub)
+{
+	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
+	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
+
+	if (!sub || !sub->lowlatency)
+		return 0;
+
+	/* under the stream lock, irqs are off: scalar packers only.
+	 * Periods are reported by the next urb completion */
+	mytek_pcm_queue_out(rt, NULL);
+	return 0;
+}
+
+/*
+ * dma_off only moves when an out urb is packed. Between packs, let the
+ * reported position follow the last urb at the stream rate, so the
+ * pointer advances smoothly instead of in urb sized steps. Frames between
+ * the pointer and the speaker (the rest of the submitted out urbs plus
+ * the device's output sample delay) are reported in runtime->delay.
+ */
 static snd_pcm_uframes_t mytek_pcm_pointer(
 		struct snd_pcm_substream *alsa_sub)
 {
 	struct pcm_substream *sub = mytek_pcm_get_substream(alsa_sub);
 	struct pcm_runtime *rt = snd_pcm_substream_chip(alsa_sub);
-	unsigned long flags;
+	struct snd_pcm_runtime *alsa_rt = alsa_sub->runtime;
+	struct pcm_position pos;
+	unsigned int seq;
 	snd_pcm_uframes_t ret;
+	snd_pcm_uframes_t lag;
+	snd_pcm_uframes_t done;
+	s64 elapsed;
 
 	if (rt->panic || !sub)
 		return SNDRV_PCM_POS_XRUN;
 
-	spin_lock_irqsave(&sub->lock, flags);
-	ret = sub->dma_off;
-	spin_unlock_irqrestore(&sub->lock, flags);
+	/* polled often by timer scheduled servers, so no lock here */
+	do {
+		seq = read_seqcount_begin(&sub->pos.seq);
+		pos.dma_off = sub->pos.dma_off;
+		pos.in_flight = sub->pos.in_flight;
+		pos.last_frames = sub->pos.last_frames;
+		pos.pack_time = sub->pos.pack_time;
+	} while (read_seqcount_retry(&sub->pos.seq, seq));
+
+	lag = pos.last_frames;
+	if (lag) {
+		elapsed = ktime_us_delta(ktime_get(), pos.pack_time);
+		done = elapsed > 0 ? div_u64((u64) elapsed * alsa_rt->rate,
+				USEC_PER_SEC) : 0;
+		lag -= min(lag, done);
+	}
+	ret = pos.dma_off + alsa_rt->buffer_size - lag;
+	if (ret >= alsa_rt->buffer_size)
+		ret -= alsa_rt->buffer_size;
+	alsa_rt->delay = pos.in_flight - min(pos.in_flight, lag)
+			+ rt->chip->control->out_sample_delay;
 
 	return ret;
 }
 
+/*
+ * Out urb sources besides the pcm substream (the compress device).
+ * Only one of them owns the stream at a time.
+ */
+int mytek_pcm_source_open(struct pcm_runtime *rt,
+		bool (*source)(struct pcm_runtime *rt, struct pcm_urb *urb))
+{
+	int ret = 0;
+
+	if (rt->panic)
+		return -EPIPE;
+
+	mutex_lock(&rt->stream_mutex);
+	if (rt->playback.instance || rt->source)
+		ret = -EBUSY;
+	else {
+		mytek_pcm_unlinger(rt);
+		WRITE_ONCE(rt->source, source);
+	}
+	mutex_unlock(&rt->stream_mutex);
+
+	return ret;
+}
+
+/* start streaming at 'rate' with the full urb ring */
+int mytek_pcm_source_start(struct pcm_runtime *rt, unsigned int rate)
+{
+	int ret;
+
+	if (rt->panic)
+		return -EPIPE;
+
+	mutex_lock(&rt->stream_mutex);
+	ret = mytek_pcm_stream_setup(rt, rate, rt->max_urbs, rt->max_packets);
+	mutex_unlock(&rt->stream_mutex);
+
+	return ret;
+}
+
+void mytek_pcm_source_close(struct pcm_runtime *rt)
+{
+	mutex_lock(&rt->stream_mutex);
+	WRITE_ONCE(rt->source, NULL);
+	if (!rt->panic)
+		mytek_pcm_idle(rt);
+	mutex_unlock(&rt->stream_mutex);
+}
+
 static struct snd_pcm_ops pcm_ops = {
 	.open = mytek_pcm_open,
 	.close = mytek_pcm_close,
@@ -525,42 +1368,58 @@ static struct snd_pcm_ops pcm_ops = {
 	.prepare = mytek_pcm_prepare,
 	.trigger = mytek_pcm_trigger,
 	.pointer = mytek_pcm_pointer,
-	.page = snd_pcm_lib_get_vmalloc_page,
-	.mmap = snd_pcm_lib_mmap_vmalloc,
+	.ack = mytek_pcm_ack,
 };
 
 static void mytek_pcm_init_urb(struct pcm_urb *urb,
-		struct mytek_chip *chip, bool in, int ep,
+		struct pcm_runtime *rt, bool in, int ep,
 		void (*handler)(struct urb *))
 {
+	struct mytek_chip *chip = rt->chip;
+
 	urb->chip = chip;
-	usb_init_urb(&urb->instance);
-	urb->instance.transfer_buffer = urb->buffer;
-	urb->instance.transfer_buffer_length =
-			PCM_N_PACKETS_PER_URB * PCM_MAX_PACKET_SIZE;
-	urb->instance.dev = chip->dev;
-	urb->instance.pipe = in ? usb_rcvisocpipe(chip->dev, ep)
+	urb->packets = urb->instance->iso_frame_desc;
+	urb->instance->transfer_flags = URB_NO_TRANSFER_DMA_MAP;
+	urb->instance->dev = chip->dev;
+	urb->instance->pipe = in ? usb_rcvisocpipe(chip->dev, ep)
 			: usb_sndisocpipe(chip->dev, ep);
-	urb->instance.interval = 1;
-	urb->instance.complete = handler;
-	urb->instance.context = urb;
-	urb->instance.number_of_packets = PCM_N_PACKETS_PER_URB;
+	urb->instance->interval = 1;
+	urb->instance->complete = handler;
+	urb->instance->context = urb;
+	urb->instance->number_of_packets = rt->max_packets;
+}
+
+static int mytek_pcm_urb_alloc(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	urb->instance = usb_alloc_urb(rt->max_packets, GFP_KERNEL);
+	if (!urb->instance)
+		return -ENOMEM;
+	return 0;
+}
+
+static void mytek_pcm_urb_free(struct pcm_runtime *rt, struct pcm_urb *urb)
+{
+	mytek_pcm_urb_buffer_free(rt, urb);
+	usb_free_urb(urb->instance);
 }
 
 static int mytek_pcm_buffers_init(struct pcm_runtime *rt)
 {
 	int i;
 
-	for (i = 0; i < PCM_N_URBS; i++) {
-		rt->out_urbs[i].buffer = kzalloc(PCM_N_PACKETS_PER_URB
-				* PCM_MAX_PACKET_SIZE, GFP_KERNEL);
-		if (!rt->out_urbs[i].buffer)
+	rt->in_urbs = kcalloc(rt->max_urbs, sizeof(struct pcm_urb),
+			GFP_KERNEL);
+	rt->out_urbs = kcalloc(rt->max_out_urbs, sizeof(struct pcm_urb),
+			GFP_KERNEL);
+	if (!rt->in_urbs || !rt->out_urbs)
+		return -ENOMEM;
+
+	for (i = 0; i < rt->max_out_urbs; i++)
+		if (mytek_pcm_urb_alloc(rt, &rt->out_urbs[i]))
 			return -ENOMEM;
-		rt->in_urbs[i].buffer = kzalloc(PCM_N_PACKETS_PER_URB
-				* PCM_MAX_PACKET_SIZE, GFP_KERNEL);
-		if (!rt->in_urbs[i].buffer)
+	for (i = 0; i < rt->max_urbs; i++)
+		if (mytek_pcm_urb_alloc(rt, &rt->in_urbs[i]))
 			return -ENOMEM;
-	}
 	return 0;
 }
 
@@ -568,10 +1427,36 @@ static void mytek_pcm_buffers_destroy(struct pcm_runtime *rt)
 {
 	int i;
 
-	for (i = 0; i < PCM_N_URBS; i++) {
-		kfree(rt->out_urbs[i].buffer);
-		kfree(rt->in_urbs[i].buffer);
+	if (rt->in_urbs && rt->out_urbs) {
+		for (i = 0; i < rt->max_out_urbs; i++)
+			mytek_pcm_urb_free(rt, &rt->out_urbs[i]);
+		for (i = 0; i < rt->max_urbs; i++)
+			mytek_pcm_urb_free(rt, &rt->in_urbs[i]);
 	}
+	kfree(rt->in_urbs);
+	kfree(rt->out_urbs);
+}
+
+/* /proc/asound/cardX/stream */
+static void mytek_pcm_proc_read(struct snd_info_entry *entry,
+		struct snd_info_buffer *buffer)
+{
+	struct pcm_runtime *rt = entry->private_data;
+	unsigned int estimate = READ_ONCE(rt->fb_estimate);
+
+	snd_iprintf(buffer, "rate: %d\n", rt->rate < ARRAY_SIZE(rates)
+			? rates[rt->rate] : 0);
+	snd_iprintf(buffer, "frames per packet: %u.%03u\n",
+			estimate >> PCM_FB_FRACT,
+			((estimate & ((1 << PCM_FB_FRACT) - 1)) * 1000)
+			>> PCM_FB_FRACT);
+	snd_iprintf(buffer, "in packets: %lu\n", READ_ONCE(rt->fb_packets));
+	snd_iprintf(buffer, "empty in packets: %lu\n",
+			READ_ONCE(rt->fb_synthesized));
+	snd_iprintf(buffer, "dropped feedback: %lu\n",
+			READ_ONCE(rt->fb_dropped));
+	snd_iprintf(buffer, "out urb errors: %lu\n",
+			READ_ONCE(rt->out_errors));
 }
 
 int mytek_pcm_init(struct mytek_chip *chip)
@@ -579,12 +1464,21 @@ int mytek_pcm_init(struct mytek_chip *chip)
 	int i;
 	int ret;
 	struct snd_pcm *pcm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0)
+	struct snd_info_entry *entry;
+#endif
 	struct pcm_runtime *rt =
 			kzalloc(sizeof(struct pcm_runtime), GFP_KERNEL);
 
 	if (!rt)
 		return -ENOMEM;
 
+	rt->chip = chip;
+	rt->max_urbs = clamp_t(int, urbs, 2, PCM_MAX_URBS);
+	rt->max_out_urbs = out_urbs ? clamp_t(int, out_urbs, 2, PCM_MAX_URBS)
+			: rt->max_urbs;
+	rt->max_packets = clamp_t(int, packets_per_urb, 1,
+			PCM_MAX_PACKETS_PER_URB);
 	ret = mytek_pcm_buffers_init(rt);
 	if (ret) {
 		mytek_pcm_buffers_destroy(rt);
@@ -592,24 +1486,24 @@ int mytek_pcm_init(struct mytek_chip *chip)
 		return ret;
 	}
 
-	rt->chip = chip;
 	rt->stream_state = STREAM_DISABLED;
 	rt->rate = ARRAY_SIZE(rates);
 	init_waitqueue_head(&rt->stream_wait_queue);
 	mutex_init(&rt->stream_mutex);
+	INIT_DELAYED_WORK(&rt->linger_work, mytek_pcm_linger_work);
 
 	spin_lock_init(&rt->playback.lock);
+	seqcount_init(&rt->playback.pos.seq);
+	rt->playback.n_urbs = rt->max_urbs;
+	rt->playback.n_packets = rt->max_packets;
 
-	for (i = 0; i < PCM_N_URBS; i++) {
-		mytek_pcm_init_urb(&rt->in_urbs[i], chip, true, IN_EP,
+	for (i = 0; i < rt->max_urbs; i++)
+		mytek_pcm_init_urb(&rt->in_urbs[i], rt, true, IN_EP,
 				mytek_pcm_in_urb_handler);
-		mytek_pcm_init_urb(&rt->out_urbs[i], chip, false, OUT_EP,
+	for (i = 0; i < rt->max_out_urbs; i++)
+		mytek_pcm_init_urb(&rt->out_urbs[i], rt, false, OUT_EP,
 				mytek_pcm_out_urb_handler);
 
-		rt->in_urbs[i].peer = &rt->out_urbs[i];
-		rt->out_urbs[i].peer = &rt->in_urbs[i];
-	}
-
 	ret = snd_pcm_new(chip->card, "MytekUSB2", 0, 1, 0, &pcm);
 
 	if (ret < 0) {
@@ -623,19 +1517,35 @@ int mytek_pcm_init(struct mytek_chip *chip)
 	strcpy(pcm->name, "Mytek USB2");
 	snd_pcm_set_ops(pcm, SNDRV_PCM_STREAM_PLAYBACK, &pcm_ops);
 
-	if (ret) {
+	ret = snd_pcm_add_chmap_ctls(pcm, SNDRV_PCM_STREAM_PLAYBACK,
+			pcm_chmaps, mytek_pcm_out_channels(rt), 0, NULL);
+	if (ret < 0) {
 		mytek_pcm_buffers_destroy(rt);
 		kfree(rt);
-		dev_err(&rt->chip->dev->dev,
-			"error preallocating pcm buffers.\n");
+		dev_err(&chip->dev->dev, "cannot add channel map controls.\n");
 		return ret;
 	}
+
+	/* one physically contiguous buffer for the card's lifetime: no
+	 * allocation at hw_params, no page faults at mmap. If it fails
+	 * here, hw_params tries again */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	snd_pcm_lib_preallocate_pages_for_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS,
+			snd_dma_continuous_data(GFP_KERNEL),
+			MAX_BUFSIZE, MAX_BUFSIZE);
+#else
+	snd_pcm_set_managed_buffer_all(pcm, SNDRV_DMA_TYPE_CONTINUOUS, NULL,
+			MAX_BUFSIZE, MAX_BUFSIZE);
+#endif
 	rt->instance = pcm;
 	chip->pcm = rt;
 
-	/* Init USB issue workaround to disabled */
-	chip->usbworkaround = false;
-	dev_info(&rt->chip->dev->dev, "Init 'usbworkaround' to disabled state\n");
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 1, 0)
+	if (!snd_card_proc_new(chip->card, "stream", &entry))
+		snd_info_set_text_ops(entry, rt, mytek_pcm_proc_read);
+#else
+	snd_card_ro_proc_new(chip->card, "stream", rt, mytek_pcm_proc_read);
+#endif
 
 	return 0;
 }
@@ -648,6 +1558,7 @@ void mytek_pcm_abort(struct mytek_chip *chip)
 
 	if (rt) {
 		rt->panic = true;
+		cancel_delayed_work_sync(&rt->linger_work);
 
 		if (rt->playback.instance) {
 			snd_pcm_stream_lock_irqsave(rt->playback.instance, flags);
@@ -656,10 +1567,10 @@ void mytek_pcm_abort(struct mytek_chip *chip)
 			snd_pcm_stream_unlock_irqrestore(rt->playback.instance, flags);
 		}
 
-		for (i = 0; i < PCM_N_URBS; i++) {
-			usb_poison_urb(&rt->in_urbs[i].instance);
-			usb_poison_urb(&rt->out_urbs[i].instance);
-		}
+		for (i = 0; i < rt->max_urbs; i++)
+			usb_poison_urb(rt->in_urbs[i].instance);
+		for (i = 0; i < rt->max_out_urbs; i++)
+			usb_poison_urb(rt->out_urbs[i].instance);
 
 	}
 }
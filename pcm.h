@@ -18,35 +18,86 @@
 
 #include <sound/pcm.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
 
 #include "common.h"
+#include "pack.h"
 
 enum /* settings for pcm */
 {
+	/* upper limits of the urbs and packets_per_urb module parameters */
+	PCM_MAX_URBS = 32, PCM_MAX_PACKETS_PER_URB = 16,
 	/* maximum of EP_W_MAX_PACKET_SIZE[] (see firmware.c) */
-	PCM_N_URBS = 16, PCM_N_PACKETS_PER_URB = 8, PCM_MAX_PACKET_SIZE = 604
+	PCM_MAX_PACKET_SIZE = 604,
+	/* out urbs primed at stream start, and in lowlatency mode kept
+	 * submitted while waiting for data */
+	PCM_LOWLATENCY_URBS = 2,
+	/* feedback descriptors waiting for an out urb */
+	PCM_MAX_FEEDBACK = 2 * PCM_MAX_URBS,
+	/* frames per in packet estimate: fraction bits and averaging
+	 * weight (1 / 2^PCM_FB_SHIFT) */
+	PCM_FB_FRACT = 16, PCM_FB_SHIFT = 4
 };
 
 struct pcm_urb {
 	struct mytek_chip *chip;
 
-	/* BEGIN DO NOT SEPARATE */
-	struct urb instance;
-	struct usb_iso_packet_descriptor packets[PCM_N_PACKETS_PER_URB];
-	/* END DO NOT SEPARATE */
-	u8 *buffer;
+	struct urb *instance; /* room for max_packets iso packets */
+	struct usb_iso_packet_descriptor *packets; /* instance->iso_frame_desc */
+	u8 *buffer; /* allocated at stream start, freed when idle */
+	dma_addr_t dma; /* buffer is dma-coherent, no per submit mapping */
+	int buffer_size;
+	int frames; /* alsa frames packed into an out urb */
+	/* buffer is all silence slots but for the headers of the packets
+	 * at header_off, so silence only has to move the headers */
+	bool silent;
+	int n_headers;
+	int header_off[PCM_MAX_PACKETS_PER_URB];
+};
 
-	struct pcm_urb *peer;
+/* implicit feedback of one in urb: sizes of the out packets to send */
+struct pcm_feedback {
+	u16 length[PCM_MAX_PACKETS_PER_URB];
 };
 
+/*
+ * what the pointer callback and the urb completions touch for every urb,
+ * on its own cache line away from the packer state. Trigger publishes
+ * active without the lock (release/acquire), period_off belongs to the
+ * filling context (see mytek_pcm_queue_out). The seq protected fields
+ * are written under the substream lock and read by the pointer callback
+ * without it. The completions still take the lock for the feedback queue
+ * and the out urb lists.
+ */
+struct pcm_position {
+	bool active; /* started and not paused, set by trigger */
+	snd_pcm_uframes_t period_off; /* current position in current period */
+	seqcount_t seq;
+	snd_pcm_uframes_t dma_off; /* current position in alsa dma_area */
+	snd_pcm_uframes_t in_flight; /* frames in submitted out urbs */
+	snd_pcm_uframes_t last_frames; /* frames packed into last out urb */
+	ktime_t pack_time; /* when last out urb was packed */
+} ____cacheline_aligned_in_smp;
+
 struct pcm_substream {
 	spinlock_t lock;
 	struct snd_pcm_substream *instance;
 
-	bool active;
+	bool dop_idle; /* DSD format set up: DoP silence while inactive */
+	/* lowlatency mode, latched at open: feedback waits until the
+	 * application has written the frames it asks for */
+	bool lowlatency;
+	struct pcm_packer packer; /* selected in hw_params */
 
-	snd_pcm_uframes_t dma_off; /* current position in alsa dma_area */
-	snd_pcm_uframes_t period_off; /* current position in current period */
+	struct pcm_position pos;
+	unsigned int pack_pos; /* pos.dma_off in packer frames */
+	snd_pcm_uframes_t pack_ptr; /* alsa frames packed, wraps at boundary */
+
+	/* urb geometry requested in hw_params, used at next stream start */
+	int n_urbs;
+	int n_packets;
 };
 
 struct pcm_runtime {
@@ -56,8 +107,14 @@ struct pcm_runtime {
 	struct pcm_substream playback;
 	bool panic; /* if set driver won't do anymore pcm on device */
 
-	struct pcm_urb in_urbs[PCM_N_URBS];
-	struct pcm_urb out_urbs[PCM_N_URBS];
+	struct pcm_urb *in_urbs; /* max_urbs */
+	struct pcm_urb *out_urbs; /* max_out_urbs */
+	int max_urbs; /* allocated in urbs */
+	int max_out_urbs; /* allocated out urbs */
+	int max_packets; /* allocated iso packets per urb */
+	int n_urbs; /* in urbs of the running stream */
+	int n_out_urbs; /* out urbs of the running stream */
+	int n_packets; /* iso packets per urb of the running stream */
 	int in_packet_size;
 	int out_packet_size;
 	int in_n_analog; /* number of analog channels soundcard sends */
@@ -68,8 +125,55 @@ struct pcm_runtime {
 	u8 rate; /* one of PCM_RATE_XXX */
 	wait_queue_head_t stream_wait_queue;
 	bool stream_wait_cond;
+
+	/* packs out urbs while no substream is active, returns false for
+	 * silence. Set while the compress device owns the stream. */
+	bool (*source)(struct pcm_runtime *rt, struct pcm_urb *urb);
+
+	/* in urb completions queue their feedback, idle out urbs take it
+	 * in order (see mytek_pcm_queue_out). Protected by playback.lock */
+	struct pcm_feedback feedback[PCM_MAX_FEEDBACK];
+	int feedback_head;
+	int feedback_count;
+	struct pcm_urb *out_free[PCM_MAX_URBS]; /* idle out urbs */
+	int out_free_count;
+	int out_submitted; /* out urbs submitted and not returned */
+	bool filling; /* an out urb is filled with the lock dropped */
+
+	/* running average of the frames per in packet (PCM_FB_FRACT fixed
+	 * point), stands in for empty in packets. Protected by
+	 * playback.lock */
+	int fb_estimate;
+	int fb_phase; /* fraction carried between synthesized packets */
+	unsigned long fb_packets; /* in packets received */
+	unsigned long fb_synthesized; /* of which were empty */
+	unsigned long fb_dropped; /* feedback lost, the queue was full */
+	unsigned long out_errors; /* out urbs returned with an error */
+
+	/* after the last close the stream keeps running silence for
+	 * 'linger' seconds, a reopen at the same rate starts at once */
+	struct delayed_work linger_work;
+	bool lingering;
 };
 
+/* frames carried by an out packet of the given length */
+static inline int mytek_pcm_out_frames(struct pcm_runtime *rt, int length)
+{
+	/* at least 4 header bytes for valid packet.
+	 * after that: 32 bits per sample for analog channels */
+	if (length > 4)
+		return (length - 4) / (rt->out_n_analog << 2);
+	return 0;
+}
+
+void mytek_pcm_dop_silence(struct pcm_runtime *rt, struct pcm_packer *p,
+		struct pcm_urb *urb);
+int mytek_pcm_out_channels(struct pcm_runtime *rt);
+int mytek_pcm_source_open(struct pcm_runtime *rt,
+		bool (*source)(struct pcm_runtime *rt, struct pcm_urb *urb));
+int mytek_pcm_source_start(struct pcm_runtime *rt, unsigned int rate);
+void mytek_pcm_source_close(struct pcm_runtime *rt);
+
 int mytek_pcm_init(struct mytek_chip *chip);
 void mytek_pcm_abort(struct mytek_chip *chip);
 void mytek_pcm_destroy(struct mytek_chip *chip);